@@ -24,6 +24,8 @@
 #include<boost/foreach.hpp>
 #include<limits>
 #include<algorithm>
+#include<unordered_map>
+#include<cstring>
 
 using namespace std;
 
@@ -38,65 +40,100 @@ int median(vector<int> &v)
     return v[n];
 }
   
-// Using Kaplan Kolgoromov
-int estimate_sample_size_x(double margin, const Parameters &params, 
-    mt19937_64 &gen)
+// Using Kaplan Kolgoromov, the number of ballots sampled in one replicate,
+// or -1 if the risk limit is not met. Errors are placed at random among 
+// the ballots sampled, each ballot being in error with probability 
+// error_rate. Rather than drawing a uniform for every ballot up front, the
+// gap to the next error is drawn from a geometric distribution as the 
+// martingale reaches it, and only as far as the point at which sampling 
+// stops.
+static int sample_size_replicate(double margin, const Parameters &params,
+    CounterRNG &gen)
 {
     double clean  = 1.0/(2-margin);
     double one_vote_over = 0.5/(2-margin);
 
-    uniform_real_distribution<> dist(0,1);
+    const bool errors = params.error_rate > 0;
+    geometric_distribution<long> gap(errors ? min(params.error_rate,1.0):1.0);
 
-    Ints sams(params.reps, 0);
+    // Index of the next ballot in error. 
+    long next_error = errors ? gap(gen) : params.tot_auditable_ballots;
 
-    for(int i = 0; i < params.reps; ++i){
-        Doubles x(params.tot_auditable_ballots, clean);
+    double p = 1;
+    int j = 0;
 
-        for(int k = 0; k < params.tot_auditable_ballots; ++k){
-            double rf = dist(gen);
-            if(rf < params.error_rate){
-                x[k] = one_vote_over;
-            }
+    const double t = params.t;
+    const double g = params.g;
+    const double N = params.tot_auditable_ballots;
+    double sample_total = 0;
+
+    double xj = clean;
+    if(next_error == 0){
+        xj = one_vote_over;
+        next_error += 1 + gap(gen);
+    }
+    double mart = (t > 0) ? (xj+g)/(t+g) : 1;
+
+    p = min(1.0/mart,1.0);
+    j += 1;
+    for( ; p > params.risk_limit && j < N; ++j)
+    {
+        xj = clean;
+        if(next_error == j){
+            xj = one_vote_over;
+            next_error += 1 + gap(gen);
         }
 
-        double p = 1;
-        int j = 0;
+        mart *= (xj+g)*(1-j/N)/(t+g - (1/N)*sample_total);
 
-        const double t = params.t;
-        const double g = params.g;
-        const double N = params.tot_auditable_ballots;
-        double sample_total = 0;
-        double mart = (t > 0) ? (x[0]+g)/(t+g) : 1;
-    
+        if(mart < 0){
+            break;
+        }
+        else {
+            sample_total += xj+g;
+        }
         p = min(1.0/mart,1.0);
-        j += 1;
-        for( ; p > params.risk_limit && j < N; ++j)
-        {
-            mart *= (x[j]+g)*(1-j/N)/(t+g - (1/N)*sample_total);
+    }
 
-            if(mart < 0){
-                break;
-            }
-            else {
-                sample_total += x[j]+g;
-            }
-            p = min(1.0/mart,1.0);
-        }
+    return (p <= params.risk_limit) ? j : -1;
+}
 
-        if(p <= params.risk_limit){
-            sams[i] = j;
-        }
-        else{
-            return -1;
+// Each replicate draws from its own stream, keyed by the seed, contest,
+// assertion and replicate, so replicates can run in any order.
+int estimate_sample_size_x(double margin, const Parameters &params, 
+    int contest, int assertion, ThreadPool *pool)
+{
+    const uint64_t key = CounterRNG::Mix(CounterRNG::Mix(
+        CounterRNG::Mix(params.seed) ^ (uint64_t)contest) ^ 
+        (uint64_t)assertion);
+
+    Ints sams(params.reps, 0);
+    auto replicate = [&](int i){
+        CounterRNG gen(CounterRNG::Mix(key ^ (uint64_t)i));
+        sams[i] = sample_size_replicate(margin, params, gen);
+    };
+
+    if(pool == NULL || pool->size() == 1){
+        for(int i = 0; i < params.reps; ++i){
+            replicate(i);
+            if(sams[i] == -1)
+                return -1;
         }
     }
+    else{
+        pool->Run(params.reps, replicate);
+    }
 
+    for(int i = 0; i < params.reps; ++i){
+        if(sams[i] == -1)
+            return -1;
+    }
 
     return median(sams);
 }
 
-// Using Kaplan Kolgoromov
-int estimate_sample_size(double margin, const Parameters &params)
+// Using Kaplan Kolgoromov, one ballot at a time.
+static int estimate_sample_size_seq(double margin, const Parameters &params)
 {
     double x = 1.0/(2.0-margin);
     double p = 1;
@@ -131,6 +168,450 @@ int estimate_sample_size(double margin, const Parameters &params)
     return -1;
 }
 
+// For a sequence L(1), ..., L(K) whose steps L(i+1) - L(i) = step(i) are
+// monotone in i (increasing if 'convex'), find the range [first, last] of
+// k over which L is increasing. Before this range, L is decreasing.
+static void IncreasingRange(const function<double(int)> &step, int K,
+    bool convex, int &first, int &last)
+{
+    first = 1;
+    last = K;
+    if(convex){
+        // Find the first step that is positive.
+        if(step(K-1) <= 0){
+            last = 1;
+            return;
+        }
+        int lo = 1, hi = K-1;
+        while(lo < hi){
+            int mid = lo + (hi - lo)/2;
+            if(step(mid) > 0) hi = mid; else lo = mid + 1;
+        }
+        first = lo;
+    }
+    else{
+        // Find the last step that is positive.
+        if(step(1) <= 0){
+            last = 1;
+            return;
+        }
+        int lo = 1, hi = K-1;
+        while(lo < hi){
+            int mid = hi - (hi - lo)/2;
+            if(step(mid) > 0) lo = mid; else hi = mid - 1;
+        }
+        last = lo + 1;
+    }
+}
+
+// The first k in [first, last] with L(k) >= target, where L is increasing
+// over the range and L(last) >= target.
+static int FirstAtLeast(const function<double(int)> &L, int first, int last,
+    double target)
+{
+    int lo = first, hi = last;
+    while(lo < hi){
+        int mid = lo + (hi - lo)/2;
+        if(L(mid) >= target) hi = mid; else lo = mid + 1;
+    }
+    return lo;
+}
+
+// Using Kaplan Kolgoromov. With no errors, sampling the (i+1)th ballot
+// multiplies the martingale by (N-i)/(c-i+1), where c = N(t+g)/(x+g). The 
+// log of the martingale after k ballots is then a difference of log gamma
+// functions, and these factors are monotone in i, so the first k at which 
+// the martingale reaches 1/risk_limit is found by bisection over the k for
+// which it is increasing. Where this is too close to call in floating point,
+// or the martingale could turn negative, the ballots are stepped through 
+// one at a time, so the result is always that of estimate_sample_size_seq.
+//
+// The trajectory of the martingale does not depend on the risk limit, so
+// the sample sizes for a number of risk limits are found from one 
+// trajectory, each by its own bisection.
+static void estimate_sample_size_bisect(double margin, 
+    const Parameters &params, const Doubles &risk_limits, Ints &asns)
+{
+    asns.assign(risk_limits.size(), -1);
+
+    const double x = 1.0/(2.0-margin);
+    const double t = params.t;
+    const double g = params.g;
+    const double N = params.tot_auditable_ballots;
+
+    const double mart1 = (t > 0) ? (x+g)/(t+g) : 1;
+
+    // Factors are defined, and positive, for all k <= K.
+    const double c = N*(t+g)/(x+g);
+    const int K = min(N, floor(c));
+    const bool stepwise = !(mart1 > 0) || K < 2;
+
+    const double lgN = lgamma(N);
+    const double lgc = lgamma(c+1);
+
+    // A bound on the difference between logmart(k) and the log of the 
+    // martingale computed ballot by ballot. The running total of the
+    // sample there drifts by up to i^2 eps/2 (relative to x+g) over i
+    // ballots, and this is magnified in factors with small denominators.
+    const double eps = numeric_limits<double>::epsilon();
+    auto tol = [&](int k){
+        const double u = c + 1;
+        const double drift = u*u*log((u - 0.5)/(u - k + 0.5)) - 
+            (k-1)*(u + k/2.0);
+        return 4*eps*(max(drift, 0.0) + 16*k + fabs(lgN) + fabs(lgc)); };
+
+    // log of the martingale after k ballots, and of the factor for i.
+    auto logmart = [&](int k){ 
+        return log(mart1) + (lgN - lgamma(N-k+1)) - (lgc - lgamma(c-k+2)); };
+    auto logfactor = [&](int i){ return log(N-i) - log(c-i+1); };
+
+    // The martingale is increasing for k in [first, last].
+    int first = 1;
+    int last = K;
+    double lmax = 0;
+    if(N > 1 && !stepwise){
+        IncreasingRange(logfactor, K, N*(x - t) > x + g, first, last);
+        lmax = logmart(last);
+    }
+
+    for(int r = 0; r < risk_limits.size(); ++r){
+        Parameters rparams(params);
+        rparams.risk_limit = risk_limits[r];
+
+        if(min(1.0/mart1, 1.0) <= rparams.risk_limit){
+            asns[r] = 1;
+            continue;
+        }
+        if(N <= 1){
+            continue;
+        }
+        if(stepwise){
+            asns[r] = estimate_sample_size_seq(margin, rparams);
+            continue;
+        }
+
+        const double target = -log(rparams.risk_limit);
+        if(lmax < target - tol(last) && K == N){
+            continue;
+        }
+        if(lmax < target + tol(last)){
+            asns[r] = estimate_sample_size_seq(margin, rparams);
+            continue;
+        }
+
+        const int lo = FirstAtLeast(logmart, first, last, target);
+        if(fabs(logmart(lo) - target) <= tol(lo) || 
+            (lo > first && fabs(logmart(lo-1) - target) <= tol(lo))){
+            asns[r] = estimate_sample_size_seq(margin, rparams);
+            continue;
+        }
+        asns[r] = lo;
+    }
+}
+
+static int estimate_sample_size_bisect(double margin, const Parameters &params)
+{
+    Ints asns;
+    estimate_sample_size_bisect(margin, params, 
+        Doubles(1, params.risk_limit), asns);
+    return asns[0];
+}
+
+// With errors, the log of each factor of the martingale is replaced by its
+// expectation, and the running total of the sample by its expectation. The
+// log of the martingale after k ballots is then, as for the error-free 
+// estimate, a difference of log gamma functions, plus a drift of 
+// log(a_log/a) per ballot. Here a is the expected value of x+g, and 
+// log(a_log) the expected value of log(x+g). The log of the martingale is
+// a sum of many small independent terms, so it is near normal, and its 
+// expected path reaches 1/risk_limit close to the median stopping time.
+int estimate_sample_size_e(double margin, const Parameters &params)
+{
+    const double e = max(0.0, min(params.error_rate, 1.0));
+    const double clean = 1.0/(2-margin);
+    const double one_vote_over = 0.5/(2-margin);
+
+    const double t = params.t;
+    const double g = params.g;
+    const double N = params.tot_auditable_ballots;
+
+    // As in the simulation, the audit may stop at the first ballot, which
+    // is most likely to be clean.
+    const double mart1 = (t > 0) ? (clean+g)/(t+g) : 1;
+    if(min(1.0/mart1, 1.0) <= params.risk_limit){
+        return 1;
+    }
+
+    const double a = (1-e)*(clean+g) + e*(one_vote_over+g);
+    const double loga = (1-e)*log(clean+g) + e*log(one_vote_over+g);
+    const double drift = loga - log(a);
+
+    const double target = -log(params.risk_limit);
+    const double logmart1 = (t > 0) ? loga - log(t+g) : 0;
+    if(logmart1 >= target){
+        return 1;
+    }
+
+    const double c = N*(t+g)/a;
+    const int K = min(N, floor(c));
+    if(K < 2){
+        return -1;
+    }
+
+    const double lgN = lgamma(N);
+    const double lgc = lgamma(c+1);
+    auto logmart = [&](int k){ return logmart1 + (k-1)*drift + 
+        (lgN - lgamma(N-k+1)) - (lgc - lgamma(c-k+2)); };
+    auto logfactor = [&](int i){ return drift + log(N-i) - log(c-i+1); };
+
+    int first = 1;
+    int last = K;
+    IncreasingRange(logfactor, K, N*(a - t - g) > a, first, last);
+
+    if(logmart(last) < target){
+        return -1;
+    }
+    return FirstAtLeast(logmart, first, last, target);
+}
+
+// Sample sizes found by estimate_sample_size over the whole run, keyed by 
+// the bits of the margin and of the parameters that the estimate uses. The
+// same margins recur for many nodes of a search. The memo is shared by all
+// threads, and may be read from and written to a file between runs.
+struct ASNKey{
+    uint64_t margin;
+    uint64_t risk_limit;
+    uint64_t t;
+    uint64_t g;
+    int64_t N;
+
+    bool operator==(const ASNKey &k) const {
+        return margin == k.margin && risk_limit == k.risk_limit && 
+            t == k.t && g == k.g && N == k.N; }
+};
+
+struct ASNKeyHash{
+    size_t operator()(const ASNKey &k) const {
+        uint64_t h = k.margin;
+        h = h*0x9E3779B97F4A7C15ULL ^ k.risk_limit;
+        h = h*0x9E3779B97F4A7C15ULL ^ k.t;
+        h = h*0x9E3779B97F4A7C15ULL ^ k.g;
+        h = h*0x9E3779B97F4A7C15ULL ^ (uint64_t)k.N;
+        return h ^ (h >> 29); }
+};
+
+typedef unordered_map<ASNKey,int,ASNKeyHash> ASNMemo;
+
+static mutex asn_memo_mtx;
+static ASNMemo asn_memo;
+static long asn_memo_hits = 0;
+static long asn_memo_misses = 0;
+
+static uint64_t DoubleBits(double d){
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    return bits;
+}
+
+static ASNKey MakeASNKey(double margin, const Parameters &params){
+    ASNKey key;
+    key.margin = DoubleBits(margin);
+    key.risk_limit = DoubleBits(params.risk_limit);
+    key.t = DoubleBits(params.t);
+    key.g = DoubleBits(params.g);
+    key.N = params.tot_auditable_ballots;
+    return key;
+}
+
+int estimate_sample_size(double margin, const Parameters &params)
+{
+    const ASNKey key = MakeASNKey(margin, params);
+
+    {
+        lock_guard<mutex> lock(asn_memo_mtx);
+        ASNMemo::const_iterator it = asn_memo.find(key);
+        if(it != asn_memo.end()){
+            ++asn_memo_hits;
+            return it->second;
+        }
+        ++asn_memo_misses;
+    }
+
+    const int asn = estimate_sample_size_bisect(margin, params);
+
+    lock_guard<mutex> lock(asn_memo_mtx);
+    asn_memo[key] = asn;
+    return asn;
+}
+
+// The memo is locked once to find the margins already known, and once to 
+// add the rest, each of which is estimated once however often it appears.
+void estimate_sample_sizes(const Doubles &margins, const Parameters &params,
+    Ints &asns)
+{
+    asns.assign(margins.size(), -1);
+
+    vector<ASNKey> keys(margins.size());
+    for(int i = 0; i < margins.size(); ++i){
+        keys[i] = MakeASNKey(margins[i], params);
+    }
+
+    // Positions of margins not in the memo, by key.
+    unordered_map<ASNKey,Ints,ASNKeyHash> missing;
+    {
+        lock_guard<mutex> lock(asn_memo_mtx);
+        for(int i = 0; i < margins.size(); ++i){
+            ASNMemo::const_iterator it = asn_memo.find(keys[i]);
+            if(it != asn_memo.end()){
+                ++asn_memo_hits;
+                asns[i] = it->second;
+            }
+            else{
+                ++asn_memo_misses;
+                missing[keys[i]].push_back(i);
+            }
+        }
+    }
+
+    if(missing.empty())
+        return;
+
+    vector<pair<ASNKey,int> > found;
+    for(unordered_map<ASNKey,Ints,ASNKeyHash>::const_iterator it = 
+        missing.begin(); it != missing.end(); ++it){
+        const Ints &pos = it->second;
+        const int asn = estimate_sample_size_bisect(margins[pos[0]], params);
+        for(int k = 0; k < pos.size(); ++k){
+            asns[pos[k]] = asn;
+        }
+        found.push_back(make_pair(it->first, asn));
+    }
+
+    lock_guard<mutex> lock(asn_memo_mtx);
+    for(int i = 0; i < found.size(); ++i){
+        asn_memo[found[i].first] = found[i].second;
+    }
+}
+
+void estimate_sample_size_multi(double margin, const Parameters &params,
+    const Doubles &risk_limits, Ints &asns)
+{
+    asns.assign(risk_limits.size(), -1);
+
+    vector<ASNKey> keys(risk_limits.size());
+    bool all_known = true;
+    {
+        lock_guard<mutex> lock(asn_memo_mtx);
+        for(int r = 0; r < risk_limits.size(); ++r){
+            Parameters rparams(params);
+            rparams.risk_limit = risk_limits[r];
+            keys[r] = MakeASNKey(margin, rparams);
+
+            ASNMemo::const_iterator it = asn_memo.find(keys[r]);
+            if(it != asn_memo.end()){
+                ++asn_memo_hits;
+                asns[r] = it->second;
+            }
+            else{
+                ++asn_memo_misses;
+                all_known = false;
+            }
+        }
+    }
+
+    if(all_known)
+        return;
+
+    estimate_sample_size_bisect(margin, params, risk_limits, asns);
+
+    lock_guard<mutex> lock(asn_memo_mtx);
+    for(int r = 0; r < risk_limits.size(); ++r){
+        asn_memo[keys[r]] = asns[r];
+    }
+}
+
+void GetASNMemoStats(long &hits, long &misses, long &entries)
+{
+    lock_guard<mutex> lock(asn_memo_mtx);
+    hits = asn_memo_hits;
+    misses = asn_memo_misses;
+    entries = asn_memo.size();
+}
+
+static const char ASN_MEMO_MAGIC[8] = {'A','S','N','M','E','M','O','1'};
+
+struct ASNMemoRecord{
+    ASNKey key;
+    int64_t asn;
+};
+
+bool ReadASNMemo(const char *path)
+{
+    ifstream infile(path, ios::in | ios::binary);
+    if(!infile)
+        return false;
+
+    char magic[8];
+    uint64_t n = 0;
+    infile.read(magic, sizeof(magic));
+    infile.read((char*)&n, sizeof(n));
+    if(!infile || memcmp(magic, ASN_MEMO_MAGIC, sizeof(magic)) != 0)
+        return false;
+
+    vector<ASNMemoRecord> records;
+    for(uint64_t i = 0; i < n; ++i){
+        ASNMemoRecord r;
+        infile.read((char*)&r, sizeof(r));
+        if(!infile)
+            return false;
+        records.push_back(r);
+    }
+
+    lock_guard<mutex> lock(asn_memo_mtx);
+    for(int i = 0; i < records.size(); ++i){
+        asn_memo[records[i].key] = records[i].asn;
+    }
+    return true;
+}
+
+bool WriteASNMemo(const char *path)
+{
+    // Written to a temporary file and moved into place, so that an 
+    // interrupted write does not leave a truncated memo.
+    const string tmppath = string(path) + ".tmp";
+
+    ofstream outfile(tmppath.c_str(), ios::out | ios::binary);
+    if(!outfile)
+        return false;
+
+    {
+        lock_guard<mutex> lock(asn_memo_mtx);
+        uint64_t n = asn_memo.size();
+        outfile.write(ASN_MEMO_MAGIC, sizeof(ASN_MEMO_MAGIC));
+        outfile.write((const char*)&n, sizeof(n));
+        for(ASNMemo::const_iterator it = asn_memo.begin(); 
+            it != asn_memo.end(); ++it){
+            ASNMemoRecord r;
+            memset(&r, 0, sizeof(r));
+            r.key = it->first;
+            r.asn = it->second;
+            outfile.write((const char*)&r, sizeof(r));
+        }
+    }
+
+    outfile.close();
+    if(!outfile){
+        remove(tmppath.c_str());
+        return false;
+    }
+
+    if(rename(tmppath.c_str(), path) != 0){
+        remove(tmppath.c_str());
+        return false;
+    }
+    return true;
+}
+
 bool RevCompareAudit(const AuditSpec &a1, const AuditSpec &a2){
     return a1.asn > a2.asn;
 }
@@ -184,13 +665,22 @@ double EstimateASN_VIABLE(const Contest &ctest, int c, const Ints &tallies,
 
 double EstimateASN_NONVIABLE(const Contest &ctest, int c, const Ints &tallies,
     int exhausted, const Parameters &params, double &margin)
+{
+    if(!Margin_NONVIABLE(ctest, c, tallies, exhausted, params, margin))
+        return -1;
+
+    return estimate_sample_size(margin, params);
+}
+
+bool Margin_NONVIABLE(const Contest &ctest, int c, const Ints &tallies,
+    int exhausted, const Parameters &params, double &margin)
 {
     // We are checking that candidate 'c' is not viable (tally < 15%+1) in
     // the setting where 'elim' are eliminated. We frame this assertion as
     // having a winner (all candidates other than 'c') and a loser 'c'. 
     // We are checking whether the winner has >= 85% votes.
     if(tallies[c] >= ctest.threshold)
-        return -1;
+        return false;
 
     double share = 1.0/(2*(1 - ctest.threshold_fr));
     double assorter_total = exhausted*0.5;
@@ -204,16 +694,16 @@ double EstimateASN_NONVIABLE(const Contest &ctest, int c, const Ints &tallies,
         total_tally += tallies[i];
     }
 
-    if(total_tally <= (1-ctest.threshold_fr)*ctest.rballots.size()){
-        return -1;
+    if(total_tally <= (1-ctest.threshold_fr)*ctest.num_rballots){
+        return false;
     }
 
     margin = 2*(assorter_total/params.tot_auditable_ballots) - 1;
-    return estimate_sample_size(margin, params);
+    return true;
 }
 
-double FindBestIRV_NEB(const Contest &ctest, const Ints &tail, 
-    const SInts &winners, const Parameters &params, 
+double FindBestIRV_NEB(const Contest &ctest, const CandidateList &tail, 
+    const CandidateSet &winners, const Parameters &params, 
     const Ints &tallies, const Audits2d &nebs, const Bools2d &has_neb,
     AuditSpec &best_audit)
 {
@@ -222,31 +712,25 @@ double FindBestIRV_NEB(const Contest &ctest, const Ints &tail,
     best_audit.winner = winner;
 
     // Expand tail with candidates in winners
-    Ints exp_tail(tail);
-    for(SInts::const_iterator cit=winners.begin();cit!=winners.end();++cit){
+    Ints exp_tail;
+    for(int i = 0; i < tail.size(); ++i){
+        exp_tail.push_back(tail[i]);
+    }
+    for(CandidateSet::const_iterator cit = winners.begin(); 
+        cit != winners.end(); ++cit){
         exp_tail.push_back(*cit);
     }
 
-	double smallest = -1;
-
     // Estimation has been reworked to take into account
     // that we could sample ballots that do not involve this
     // contest (ie. tot_auditable_ballots >= rep_ballots.size()
+    //
+    // The sample size is non-increasing in the margin, so of the IRV 
+    // assertions only the one with the largest margin is estimated.
+    AuditSpec irv_audit(best_audit);
+    irv_audit.loser = -1;
 	for(int i = 1; i < exp_tail.size(); ++i){
-		// exp_tail[i] is the "loser"
 		const int taili = exp_tail[i];
-
-        // Check NEB
-        if(has_neb[winner][taili]){
-            const AuditSpec &neb_wi = nebs[winner][taili];
-            if(neb_wi.asn != -1 && ((smallest == -1) |
-                (neb_wi.asn < smallest))){
-                best_audit = neb_wi;
-                smallest = neb_wi.asn;
-            }
-        }
-
-        // Check IRV assertion.
         if(tallies[winner] <= tallies[taili])
             continue;
 
@@ -262,16 +746,37 @@ double FindBestIRV_NEB(const Contest &ctest, const Ints &tail,
             params.tot_auditable_ballots;
 
 		double margin = 2*amean - 1;
-        double candasn = estimate_sample_size(margin,params);
+        if(irv_audit.loser == -1 || margin > irv_audit.margin){
+            irv_audit.loser = taili;
+            irv_audit.margin = margin;
+        }
+    }
 
-		if(smallest == -1 || candasn < smallest){
-			best_audit.asn = candasn;
-			best_audit.loser = taili;
-            best_audit.margin = margin;
+	double smallest = -1;
+	for(int i = 1; i < exp_tail.size(); ++i){
+		// exp_tail[i] is the "loser"
+		const int taili = exp_tail[i];
 
-			smallest = candasn;
-		}
-	}
+        // Check NEB
+        if(has_neb[winner][taili]){
+            const AuditSpec &neb_wi = nebs[winner][taili];
+            if(neb_wi.asn != -1 && ((smallest == -1) |
+                (neb_wi.asn < smallest))){
+                best_audit = neb_wi;
+                smallest = neb_wi.asn;
+            }
+        }
+    }
+
+    // Check IRV assertion.
+    if(irv_audit.loser != -1){
+        irv_audit.asn = estimate_sample_size(irv_audit.margin, params);
+        if(irv_audit.asn != -1 && (smallest == -1 || 
+            irv_audit.asn < smallest)){
+            best_audit = irv_audit;
+            smallest = irv_audit.asn;
+        }
+    }
 
 	return smallest;
 }
@@ -30,7 +30,7 @@ struct AuditSpec{
     int winner;
 	int loser;
 
-	Ints eliminated;
+	CandidateSet eliminated;
 
     double thresh;
 
@@ -54,14 +54,72 @@ double EstimateASN_VIABLE(const Contest &ctest, int c, const Ints &tallies,
 
 int estimate_sample_size(double margin, const Parameters &params);
 
+// As estimate_sample_size, at each of a number of risk limits (in place 
+// of params.risk_limit), from one trajectory of the martingale.
+void estimate_sample_size_multi(double margin, const Parameters &params,
+    const Doubles &risk_limits, Ints &asns);
+
+// As estimate_sample_size, for each of a batch of margins.
+void estimate_sample_sizes(const Doubles &margins, const Parameters &params,
+    Ints &asns);
+
+// Sample sizes from estimate_sample_size are memoised for the whole run.
+// The number of lookups answered from the memo, and not, and its size.
+void GetASNMemoStats(long &hits, long &misses, long &entries);
+
+// Add the sample sizes memoised in a file by an earlier run to the memo, or
+// write the memo to a file. Both return false on failure.
+bool ReadASNMemo(const char *path);
+bool WriteASNMemo(const char *path);
+
 double EstimateASN_NONVIABLE(const Contest &ctest, int c, const Ints &tallies,
     int exhausted, const Parameters &params, double &margin); 
 
+// The margin of the assertion that 'c' is not viable, as used by 
+// EstimateASN_NONVIABLE, or false if the assertion cannot hold. 
+bool Margin_NONVIABLE(const Contest &ctest, int c, const Ints &tallies,
+    int exhausted, const Parameters &params, double &margin);
+
 // Compute ASN to show that tail[0] beats one of tail[1..n] or i in winners
-double FindBestIRV_NEB(const Contest &ctest, const Ints &tail, 
-    const SInts &winners, const Parameters &params, const Ints &tallies, 
+double FindBestIRV_NEB(const Contest &ctest, const CandidateList &tail, 
+    const CandidateSet &winners, const Parameters &params, const Ints &tallies, 
     const Audits2d &nebs, const Bools2d &has_neb, AuditSpec &audit);
 
-int estimate_sample_size_x(double margin, const Parameters &params, std::mt19937_64 &gen);
+// An approximation, without simulation, to the median sample size found by
+// estimate_sample_size_x.
+int estimate_sample_size_e(double margin, const Parameters &params);
+
+// A counter based random number generator. The nth number in the stream 
+// with a given key is a hash of the key and n, so that streams with 
+// different keys need no shared state, and can be drawn from in any order.
+class CounterRNG
+{
+    private:
+        uint64_t key;
+        uint64_t counter;
+
+    public:
+        typedef uint64_t result_type;
+
+        CounterRNG(uint64_t k) : key(k), counter(0) {}
+
+        // SplitMix64 finaliser.
+        static uint64_t Mix(uint64_t z){
+            z += 0x9E3779B97F4A7C15ULL;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            return z ^ (z >> 31); }
+
+        static constexpr result_type min() { return 0; }
+        static constexpr result_type max() { return ~(result_type)0; }
+
+        result_type operator()() { return Mix(key ^ Mix(++counter)); }
+};
+
+// Median sample size, over params.reps replicates with random errors, for 
+// assertion 'assertion' of contest 'contest'. Replicates are run on the 
+// thread pool, if given, and the result depends only on params.seed.
+int estimate_sample_size_x(double margin, const Parameters &params, 
+    int contest, int assertion, ThreadPool *pool = NULL);
 
 #endif
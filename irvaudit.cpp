@@ -27,6 +27,7 @@
 #include<boost/property_tree/json_parser.hpp>
 #include<boost/math/special_functions/binomial.hpp>
 #include<random>
+#include<unordered_map>
 
 #include "model.h"
 #include "audit.h"
@@ -41,15 +42,15 @@ void print_list(const Ints &list){
 }
 
 struct SimpleNode{
-    SInts head;
-    Ints tail;
+    CandidateSet head;
+    CandidateList tail;
     double estimate;
     AuditSpec best_audit;
 };
 
 struct Node{
-    SInts head;
-    Ints tail;
+    CandidateSet head;
+    CandidateList tail;
     double estimate;
     AuditSpec best_audit;
 
@@ -82,35 +83,17 @@ Node CreateNode(const SimpleNode &sn){
 }
 
 
-bool subset_of(const Ints &l1, const Ints &l2){
-    if(l1.size() > l2.size())
-        return false;
-
-    Ints l1_temp(l1);
-    Ints l2_temp(l2);
-
-    sort(l1_temp.begin(), l1_temp.end());
-    sort(l2_temp.begin(), l2_temp.end());
-
-    for(int i = 0; i < l1_temp.size(); ++i)
-        if(l1_temp[i] != l2_temp[i])
-            return false;
-
-    return true;
-}
-
-
 // Does audit a1 subsume a2
 bool Subsumes(const AuditSpec &a1, const AuditSpec &a2){
     if(a1.type == VIABLE && a2.type == VIABLE && a1.winner == a2.winner){
         // If a1's eliminated set is a subset of a2's, return true
-        if(subset_of(a1.eliminated, a2.eliminated)){
+        if(a1.eliminated.SubsetOf(a2.eliminated)){
             return true;
         } 
     }
     else if(a1.type==NONVIABLE && a2.type==NONVIABLE && a1.winner==a2.winner){
         // if a2's eliminated set is a subset of a1's, return true
-        if(subset_of(a2.eliminated, a1.eliminated)){
+        if(a2.eliminated.SubsetOf(a1.eliminated)){
             return true;
         }
     }
@@ -181,7 +164,8 @@ void PrintNode(const Node &n, const Candidates &cand){
         }
     }
     cout << "( ";
-    for(SInts::const_iterator cit=n.head.begin(); cit!=n.head.end(); ++cit){
+    for(CandidateSet::const_iterator cit = n.head.begin(); 
+        cit != n.head.end(); ++cit){
         cout << cand[*cit].id << " ";
     }
     cout << ") [";
@@ -196,7 +180,7 @@ void PrintNode(const Node &n, const Candidates &cand){
             }
         }
         cout << "( ";
-        for(SInts::const_iterator cit = n.best_ancestor.head.begin(); 
+        for(CandidateSet::const_iterator cit=n.best_ancestor.head.begin();
             cit != n.best_ancestor.head.end(); ++cit){
             cout << cand[*cit].id << " ";
         }
@@ -237,9 +221,10 @@ void OutputToJSON(const Contests &contests, const vector<Audits> &torun,
                     child.put("loser", -1);
 
                 ptree aelim;
-                for(int j = 0; j < spec.eliminated.size(); ++j){
+                for(CandidateSet::const_iterator cit=spec.eliminated.begin();
+                    cit != spec.eliminated.end(); ++cit){
                     ptree c;
-                    c.put("", ctest.cands[spec.eliminated[j]].id);
+                    c.put("", ctest.cands[*cit].id);
                     aelim.push_back(std::make_pair("", c));
                 }
                 child.add_child("already_eliminated", aelim);
@@ -318,8 +303,9 @@ void PrintAudit(const AuditSpec &audit, const Candidates &cand){
             audit.thresh << ",Eliminated";
     }
 
-    for(int i = 0; i < audit.eliminated.size(); ++i){
-        cout << "," << cand[audit.eliminated[i]].id;
+    for(CandidateSet::const_iterator cit = audit.eliminated.begin();
+        cit != audit.eliminated.end(); ++cit){
+        cout << "," << cand[*cit].id;
     }
     cout << ",MARGIN," << audit.margin << endl;
 }
@@ -332,56 +318,436 @@ void PrintFrontier(const Frontier &front, const Candidates &cand){
     }
 }
 
-int ComputeTallies(const Contest &ctest,const Ints &eliminated,Ints &tallies){
-    Ints elim(ctest.ncandidates, 0);
+// Tallies are computed over the contest's trie of ballot rankings. Once a
+// ballot prefix reaches a continuing candidate, all ballots sharing that 
+// prefix go to that candidate, and the subtree below it is skipped.
+// Tries with at least this many nodes are tallied on multiple threads.
+const uint32_t PARALLEL_TRIE_NODES = 1 << 16;
+
+// Split the nodes of a trie below its root into ranges of whole subtrees, 
+// of roughly equal numbers of nodes, at most one per thread of the pool.
+void SplitTrie(const BallotTrie &trie, int nranges, 
+    vector<uint32_t> &bounds){
+    bounds.assign(1, 1);
+    const uint32_t n = trie.size();
+    for(uint32_t i = 1; i < n; i = trie.skip[i]){
+        if(trie.skip[i] - bounds.back() >= (n - 1)/nranges){
+            bounds.push_back(trie.skip[i]);
+        }
+    }
+    if(bounds.back() != n){
+        bounds.push_back(n);
+    }
+}
+
+// Add the tallies of the ballots in nodes [first, last) of the trie, a range
+// of whole subtrees below the root, and return the number exhausted.
+int TallyTrie(const BallotTrie &trie, const Ints &elim, uint32_t first,
+    uint32_t last, Ints &tallies){
     int exhausted = 0;
-    for(int i = 0; i < eliminated.size(); ++i){
-        elim[eliminated[i]] = 1;
+    for(uint32_t i = first; i < last; ){
+        int pc = trie.cand[i];
+        if(elim[pc]){
+            exhausted += trie.ends[i];
+            ++i;
+            continue;
+        }
+
+        tallies[pc] += trie.count[i];
+        i = trie.skip[i];
+    } 
+    return exhausted;
+}
+
+// With a thread pool, a large trie is split into ranges of subtrees that
+// are tallied concurrently into separate tallies. These are integer counts,
+// so the result does not depend on the number of threads.
+int ComputeTallies(const Contest &ctest, const CandidateSet &eliminated,
+    Ints &tallies, ThreadPool *pool = NULL){
+    Ints elim(ctest.ncandidates, 0);
+    for(CandidateSet::const_iterator cit = eliminated.begin();
+        cit != eliminated.end(); ++cit){
+        elim[*cit] = 1;
     }
 
-    for(int i = 0; i < ctest.rballots.size(); ++i){
-        const Ints &prefs = ctest.rballots[i].prefs;
-        bool ex = true;
-        for(int j = 0; j < prefs.size(); ++j){
-            int pc = prefs[j];
-            if(elim[pc])
-                continue;
+    const BallotTrie &trie = ctest.trie;
+    if(pool == NULL || pool->size() == 1 || trie.size()<PARALLEL_TRIE_NODES){
+        return trie.ends[0] + TallyTrie(trie, elim, 1, trie.size(), tallies);
+    }
 
-            tallies[pc] += 1;
-            ex = false;
-            break;
+    vector<uint32_t> bounds;
+    SplitTrie(trie, pool->size(), bounds);
+
+    const int nranges = bounds.size() - 1;
+    Ints2d partial(nranges, Ints(ctest.ncandidates, 0));
+    Ints exhausted(nranges, 0);
+    pool->Run(nranges, [&](int k){
+        exhausted[k] = TallyTrie(trie, elim, bounds[k], bounds[k+1],
+            partial[k]);
+    });
+
+    int total_exhausted = trie.ends[0];
+    for(int k = 0; k < nranges; ++k){
+        for(int c = 0; c < ctest.ncandidates; ++c){
+            tallies[c] += partial[k][c];
+        }
+        total_exhausted += exhausted[k];
+    }
+    return total_exhausted;
+}
+
+// Add to neb[j][i], for each pair of candidates j != i, the number of 
+// ballots in nodes [first, last) of the trie (a range of whole subtrees 
+// below the root) on which j is ranked and i is not ranked above j. 
+void NEBTallyTrie(const BallotTrie &trie, uint32_t first, uint32_t last,
+    Ints2d &neb){
+    const int ncand = neb.size();
+
+    // Candidates ranked on the path to the current node, and the nodes on 
+    // that path at which they were first ranked.
+    Ints seen(ncand, 0);
+    vector<uint32_t> path;
+    for(uint32_t v = first; v < last; ++v){
+        while(!path.empty() && trie.skip[path.back()] <= v){
+            seen[trie.cand[path.back()]] = 0;
+            path.pop_back();
+        }
+
+        int j = trie.cand[v];
+        if(seen[j])
+            continue;
+
+        Ints &row = neb[j];
+        const int n = trie.count[v];
+        for(int i = 0; i < ncand; ++i){
+            if(!seen[i] && i != j) row[i] += n;
         }
-        if(ex) exhausted += 1;
+
+        seen[j] = 1;
+        path.push_back(v);
     } 
-    return exhausted;
 }
 
-int ComputeNEBTally(const Contest &ctest, int loser, int winner){
+// Compute, in one pass over the trie of ballot rankings, neb[j][i]: the 
+// number of ballots on which candidate j is ranked above candidate i (or 
+// j is ranked and i is not). With a thread pool, a large trie is split into
+// ranges of subtrees, counted separately and summed in order.
+void ComputeNEBTallies(const Contest &ctest, Ints2d &neb, ThreadPool *pool){
+    const BallotTrie &trie = ctest.trie;
+    neb.assign(ctest.ncandidates, Ints(ctest.ncandidates, 0));
+    if(pool == NULL || pool->size() == 1 || trie.size()<PARALLEL_TRIE_NODES){
+        NEBTallyTrie(trie, 1, trie.size(), neb);
+        return;
+    }
 
-    int loser_tally = 0;
+    vector<uint32_t> bounds;
+    SplitTrie(trie, pool->size(), bounds);
 
-    for(int i = 0; i < ctest.rballots.size(); ++i){
-        const Ints &prefs = ctest.rballots[i].prefs;
+    const int nranges = bounds.size() - 1;
+    vector<Ints2d> partial(nranges, neb);
+    pool->Run(nranges, [&](int k){
+        NEBTallyTrie(trie, bounds[k], bounds[k+1], partial[k]);
+    });
 
-        // If loser appears before winner, then increment loser_tally
-        for(int j = 0; j < prefs.size(); ++j){
-            if(prefs[j] == loser){
-                loser_tally += 1;
-                break;
+    for(int k = 0; k < nranges; ++k){
+        for(int j = 0; j < ctest.ncandidates; ++j){
+            for(int i = 0; i < ctest.ncandidates; ++i){
+                neb[j][i] += partial[k][j][i];
             }
+        }
+    }
+}
 
-            if(prefs[j] == winner){
-                break;
+// Add to moved[c][t], for each eliminated candidate c (elim[c] = 1), the 
+// number of ballots in nodes [first, last) of the trie (a range of whole 
+// subtrees below the root) that rank c above every continuing candidate, 
+// and whose tally goes to continuing candidate t. These ballots move to c
+// if c alone is restored. Column ncand counts such ballots that exhaust.
+void DeltaTallyTrie(const BallotTrie &trie, const Ints &elim, uint32_t first,
+    uint32_t last, Ints2d &moved){
+    const int ncand = moved.size();
+
+    // Eliminated candidates on the path to the current node.
+    vector<uint32_t> path;
+    for(uint32_t v = first; v < last; ){
+        while(!path.empty() && trie.skip[path.back()] <= v){
+            path.pop_back();
+        }
+
+        int pc = trie.cand[v];
+        if(elim[pc]){
+            path.push_back(v);
+            if(trie.ends[v] != 0){
+                for(int k = 0; k < path.size(); ++k){
+                    moved[trie.cand[path[k]]][ncand] += trie.ends[v];
+                }
             }
+            ++v;
+            continue;
         }
-    } 
-    return loser_tally;
+
+        for(int k = 0; k < path.size(); ++k){
+            moved[trie.cand[path[k]]][pc] += trie.count[v];
+        }
+        v = trie.skip[v];
+    }
+}
+
+// Compute 'moved' as DeltaTallyTrie over the whole trie of the contest, 
+// splitting a large trie over the thread pool as in ComputeTallies.
+void ComputeDeltaTallies(const Contest &ctest, const Ints &elim, 
+    Ints2d &moved, ThreadPool *pool){
+    const BallotTrie &trie = ctest.trie;
+    const int ncand = ctest.ncandidates;
+    if(pool == NULL || pool->size() == 1 || trie.size()<PARALLEL_TRIE_NODES){
+        DeltaTallyTrie(trie, elim, 1, trie.size(), moved);
+        return;
+    }
+
+    vector<uint32_t> bounds;
+    SplitTrie(trie, pool->size(), bounds);
+
+    const int nranges = bounds.size() - 1;
+    vector<Ints2d> partial(nranges, Ints2d(ncand, Ints(ncand+1, 0)));
+    pool->Run(nranges, [&](int k){
+        DeltaTallyTrie(trie, elim, bounds[k], bounds[k+1], partial[k]);
+    });
+
+    for(int k = 0; k < nranges; ++k){
+        for(int c = 0; c < ncand; ++c){
+            for(int t = 0; t <= ncand; ++t){
+                moved[c][t] += partial[k][c][t];
+            }
+        }
+    }
+}
+
+// The tallies of a contest for every set of eliminated candidates, indexed 
+// by the set as a bit mask. Each row holds the tally of each candidate (zero
+// if eliminated) followed by the number of exhausted ballots. A ballot goes
+// to continuing candidate c whenever all the candidates it ranks above c
+// are eliminated, so each trie node's ballots are placed at the set of 
+// candidates above it, and the rows are then summed over subsets.
+class TallyTable
+{
+    private:
+        int ncand;
+        vector<int> rows;
+
+    public:
+        TallyTable() : ncand(0) {}
+
+        // Build the table, if it needs at most max_mb megabytes. Returns
+        // false, leaving the table empty, if not.
+        bool Build(const Contest &ctest, double max_mb, ThreadPool *pool);
+
+        bool empty() const { return rows.empty(); }
+        double MB() const { return rows.size()*sizeof(int)/(1024.0*1024); }
+
+        // As ComputeTallies.
+        int Lookup(const CandidateSet &eliminated, Ints &tallies) const;
+};
+
+bool TallyTable::Build(const Contest &ctest, double max_mb, 
+    ThreadPool *pool){
+    rows.clear();
+    const int n = ctest.ncandidates;
+    if(n > 30 || (n+1)*sizeof(int)*pow(2.0, n) > max_mb*1024*1024){
+        return false;
+    }
+
+    ncand = n;
+    const size_t width = n + 1;
+    const size_t nsets = ((size_t)1) << n;
+    rows.assign(nsets*width, 0);
+
+    // Candidates ranked on the path to (and including) each node on the 
+    // path to the current node.
+    const BallotTrie &trie = ctest.trie;
+    vector<uint32_t> path;
+    vector<uint32_t> ranked;
+    rows[n] += trie.ends[0];
+    for(uint32_t v = 1; v < trie.size(); ++v){
+        while(!path.empty() && trie.skip[path.back()] <= v){
+            path.pop_back();
+            ranked.pop_back();
+        }
+
+        const uint32_t above = ranked.empty() ? 0 : ranked.back();
+        const uint32_t bit = ((uint32_t)1) << trie.cand[v];
+        if(!(above & bit)){
+            rows[above*width + trie.cand[v]] += trie.count[v];
+        }
+
+        path.push_back(v);
+        ranked.push_back(above | bit);
+        rows[(above | bit)*width + n] += trie.ends[v];
+    }
+
+    // Sum over subsets, one candidate at a time. Rows of sets holding 
+    // candidate j are updated from rows of sets without it, so the sets
+    // can be split over the threads of the pool.
+    const int nranges = (pool == NULL) ? 1 : pool->size();
+    for(int j = 0; j < n; ++j){
+        const size_t bit = ((size_t)1) << j;
+        auto add = [&](int k){
+            const size_t first = (nsets/nranges)*k;
+            const size_t last = (k == nranges-1) ? nsets : first+nsets/nranges;
+            for(size_t set = first; set < last; ++set){
+                if(!(set & bit))
+                    continue;
+
+                int *row = &rows[set*width];
+                const int *sub = &rows[(set ^ bit)*width];
+                for(int c = 0; c <= n; ++c){
+                    if(c != j) row[c] += sub[c];
+                }
+            }
+        };
+
+        if(nranges == 1){
+            add(0);
+        }
+        else{
+            pool->Run(nranges, add);
+        }
+    }
+    return true;
+}
+
+int TallyTable::Lookup(const CandidateSet &eliminated, Ints &tallies) const{
+    const int *row = &rows[eliminated.Low()*(ncand+1)];
+    tallies.assign(row, row + ncand);
+    return row[ncand];
+}
+
+// Tallies computed for a contest, keyed by the set of eliminated candidates
+// as a bit mask. Many nodes considered in a search share the same set of 
+// eliminated candidates. The cache holds at most a fixed number of entries,
+// dropping the least recently used entry when full. Contests with more than
+// 64 candidates bypass the cache. Optionally, a table of the tallies for 
+// every set of eliminated candidates is built up front, and used instead.
+class TallyCache
+{
+    private:
+        struct Entry{
+            Ints tallies;
+            int exhausted;
+            list<uint64_t>::iterator pos;
+        };
+
+        static const size_t CAPACITY = 1 << 16;
+
+        const Contest &ctest;
+        ThreadPool *pool;
+        unordered_map<uint64_t,Entry> entries;
+        list<uint64_t> recent;
+
+    public:
+        long hits;
+        long misses;
+
+        // Empty unless built, within a memory cap of table_mb megabytes.
+        TallyTable table;
+
+        TallyCache(const Contest &c, ThreadPool *p, double table_mb) : 
+            ctest(c), pool(p), hits(0), misses(0) {
+            if(table_mb > 0) table.Build(ctest, table_mb, pool); }
+
+        // As ComputeTallies, given 'tallies' initialised to zero.
+        int Compute(const CandidateSet &eliminated, Ints &tallies);
+
+        // Cache the tallies for each set formed by restoring one candidate
+        // of 'eliminated'. These are derived from the tallies given 
+        // 'eliminated' by moving only the ballots whose tally changes, 
+        // found for all of the sets in a single pass over the trie.
+        void Expand(const CandidateSet &eliminated);
+
+    private:
+        void Insert(uint64_t mask, const Ints &tallies, int exhausted);
+};
+
+void TallyCache::Insert(uint64_t mask, const Ints &tallies, int exhausted){
+    unordered_map<uint64_t,Entry>::iterator it = entries.find(mask);
+    if(it != entries.end()){
+        recent.erase(it->second.pos);
+    }
+    else if(entries.size() >= CAPACITY){
+        entries.erase(recent.back());
+        recent.pop_back();
+    }
+
+    recent.push_front(mask);
+    Entry &e = entries[mask];
+    e.tallies = tallies;
+    e.exhausted = exhausted;
+    e.pos = recent.begin();
+}
+
+int TallyCache::Compute(const CandidateSet &eliminated, Ints &tallies){
+    if(!table.empty()){
+        ++hits;
+        return table.Lookup(eliminated, tallies);
+    }
+
+    if(ctest.ncandidates > 64){
+        return ComputeTallies(ctest, eliminated, tallies, pool);
+    }
+
+    const uint64_t mask = eliminated.Low();
+
+    unordered_map<uint64_t,Entry>::iterator it = entries.find(mask);
+    if(it != entries.end()){
+        ++hits;
+        recent.splice(recent.begin(), recent, it->second.pos);
+        tallies = it->second.tallies;
+        return it->second.exhausted;
+    }
+
+    ++misses;
+    int exhausted = ComputeTallies(ctest, eliminated, tallies, pool);
+    Insert(mask, tallies, exhausted);
+    return exhausted;
+}
+
+void TallyCache::Expand(const CandidateSet &eliminated){
+    const int ncand = ctest.ncandidates;
+    if(ncand > 64 || eliminated.empty() || !table.empty()){
+        return;
+    }
+
+    Ints tallies(ncand, 0);
+    const int exhausted = Compute(eliminated, tallies);
+
+    Ints elim(ncand, 0);
+    for(CandidateSet::const_iterator cit = eliminated.begin();
+        cit != eliminated.end(); ++cit){
+        elim[*cit] = 1;
+    }
+
+    Ints2d moved(ncand, Ints(ncand+1, 0));
+    ComputeDeltaTallies(ctest, elim, moved, pool);
+
+    Ints child(ncand, 0);
+    for(CandidateSet::const_iterator cit = eliminated.begin();
+        cit != eliminated.end(); ++cit){
+        const int c = *cit;
+        child = tallies;
+        for(int t = 0; t < ncand; ++t){
+            child[t] -= moved[c][t];
+            child[c] += moved[c][t];
+        }
+        child[c] += moved[c][ncand];
+
+        Insert(eliminated.Low() & ~(((uint64_t)1) << c), child, 
+            exhausted - moved[c][ncand]);
+    }
 }
 
 double FindBestAudit(const Contest &ctest, const Parameters &params,
     Node &node, const map<int,AuditSpec> &initial_viables,
     const Ints &has_init_viable, const Audits2d &nebs, 
-    const Bools2d &has_neb, bool alglog) 
+    const Bools2d &has_neb, TallyCache &tcache, bool alglog) 
 {
     double best_estimate = -1;
 
@@ -403,8 +769,13 @@ double FindBestAudit(const Contest &ctest, const Parameters &params,
     // -- NEB(c1, c2) c1 cannot be eliminated before c2 as firstpref(c1)
     //    is greater than all_mentions_before_c1(c2)
     // -------------------------------------------------------------------
-    Ints eliminated;
-    Ints unmentioned;
+    const CandidateSet eliminated = 
+        CandidateSet::Range(ctest.ncandidates) - node.head;
+    CandidateSet unmentioned = eliminated;
+    for(int i = 0; i < node.tail.size(); ++i){
+        unmentioned.erase(node.tail[i]);
+    }
+
     Ints tallies1(ctest.ncandidates, 0);
     Ints tallies2(ctest.ncandidates, 0);
 
@@ -412,17 +783,10 @@ double FindBestAudit(const Contest &ctest, const Parameters &params,
 
     // Checking: one of the candidates not in the winners set is viable 
     //    given no one has been eliminated. V(c, emptyset)
-    // Also: define eliminated & unmentioned sets
-    for(int i = 0; i < ctest.ncandidates; ++i){
-        if(node.head.find(i) != node.head.end())
-            continue;
-
-        if(find(node.tail.begin(),node.tail.end(), i) == node.tail.end())
-            unmentioned.push_back(i);
-
-        eliminated.push_back(i);
-        if(empty && has_init_viable[i] == 1){
-            const AuditSpec &as = initial_viables.find(i)->second;
+    for(CandidateSet::const_iterator cit = eliminated.begin();
+        cit != eliminated.end() && empty; ++cit){
+        if(has_init_viable[*cit] == 1){
+            const AuditSpec &as = initial_viables.find(*cit)->second;
             if(best_estimate == -1 || as.asn < best_estimate){
                 best_estimate = as.asn;
                 node.best_audit = as;
@@ -434,25 +798,36 @@ double FindBestAudit(const Contest &ctest, const Parameters &params,
     // eliminated[c] = 1 are eliminated (tallies 1) or candidate c with
     // unmentioned[c] = 1 are eliminated (tallies 2).
     if(empty){
-        int ex1 = ComputeTallies(ctest, eliminated, tallies1);
+        int ex1 = tcache.Compute(eliminated, tallies1);
 
         // Checking: one of the winners is not viable if we treat everyone 
         //    outside of the winners set as eliminated. NV(c, C \setminus V)
-        for(SInts::iterator cit = node.head.begin();
+        //    Only the assertion with the largest margin, and so the 
+        //    smallest sample size, need be estimated.
+        int nv_winner = -1;
+        double nv_margin = 0;
+        for(CandidateSet::const_iterator cit = node.head.begin();
             cit != node.head.end(); ++cit)
         {
             double margin = 0;
-            double asn = EstimateASN_NONVIABLE(ctest, *cit, tallies1,
-                ex1, params, margin);
+            if(Margin_NONVIABLE(ctest, *cit, tallies1, ex1, params, margin)
+                && (nv_winner == -1 || margin > nv_margin)){
+                nv_winner = *cit;
+                nv_margin = margin;
+            }
+        }
+
+        if(nv_winner != -1){
+            double asn = estimate_sample_size(nv_margin, params);
 
             if((best_estimate == -1 && asn != -1) || (asn != -1 &&
                 asn < best_estimate)){
                 best_estimate = asn;
                 node.best_audit.asn = asn;
                 node.best_audit.type = NONVIABLE;
-                node.best_audit.winner = *cit;
+                node.best_audit.winner = nv_winner;
                 node.best_audit.loser = -1;
-                node.best_audit.margin = margin;
+                node.best_audit.margin = nv_margin;
 
                 node.best_audit.eliminated = eliminated;
             }
@@ -461,9 +836,10 @@ double FindBestAudit(const Contest &ctest, const Parameters &params,
         // Checking: that whether one of the unmentioned candidates, not in 
         // the viable set, could *not* have been eliminated before one of
         // the reportedly viable candidates. 
-        for(int i = 0; i < unmentioned.size(); ++i){
-            int uc = unmentioned[i];
-            for(SInts::iterator cit = node.head.begin();
+        for(CandidateSet::const_iterator uit = unmentioned.begin();
+            uit != unmentioned.end(); ++uit){
+            int uc = *uit;
+            for(CandidateSet::const_iterator cit = node.head.begin();
                 cit != node.head.end(); ++cit)
             {
                 if(has_neb[uc][*cit]){
@@ -482,7 +858,7 @@ double FindBestAudit(const Contest &ctest, const Parameters &params,
     // Checking: node.tail[0] is viable given all non-mentioned candidates
     //    have been eliminated. V(c, unmentioned \setminus {c})
     if(!empty){
-        int ex2 = ComputeTallies(ctest, unmentioned, tallies2);
+        int ex2 = tcache.Compute(unmentioned, tallies2);
         double margin = 0;
         double asn = EstimateASN_VIABLE(ctest, node.tail[0], tallies2, 
             ex2, params, margin);
@@ -556,12 +932,11 @@ void ReplaceWithBestAncestor(Frontier &front, const Node &newn,
 
 double PerformDive(const Node &toexpand, const Contest &ctest, 
     const map<int,AuditSpec> &initial_viables, const Ints &has_init_viable,
-    const Audits2d &nebs, const Bools2d &has_neb, const Parameters &params)
+    const Audits2d &nebs, const Bools2d &has_neb, const Parameters &params,
+    TallyCache &tcache)
 {
     for(int i = 0; i < ctest.ncandidates; ++i){
-        if(find(toexpand.tail.begin(), toexpand.tail.end(), i) ==
-            toexpand.tail.end() && toexpand.head.find(i) == 
-            toexpand.head.end()){
+        if(!toexpand.tail.contains(i) && !toexpand.head.contains(i)){
                     
             Node newn;
             newn.tail.push_back(i);
@@ -592,7 +967,8 @@ double PerformDive(const Node &toexpand, const Contest &ctest,
 
             newn.has_ancestor = true;
             newn.estimate = FindBestAudit(ctest, params, newn,
-                initial_viables, has_init_viable, nebs, has_neb, false);
+                initial_viables, has_init_viable, nebs, has_neb, tcache,
+                false);
 
             if(!newn.expandable){
                 bool replace = false;
@@ -616,7 +992,7 @@ double PerformDive(const Node &toexpand, const Contest &ctest,
             }
             else{
                 return PerformDive(newn, ctest, initial_viables, 
-                    has_init_viable, nebs, has_neb, params); 
+                    has_init_viable, nebs, has_neb, params, tcache); 
             }
             break;
         }
@@ -638,8 +1014,15 @@ bool form_audits_plurality(const Contest &ctest, const Parameters &params,
 {
     bool auditfailed = false;
 
+    const CandidateSet eliminations(ctest.eliminations.begin(),
+        ctest.eliminations.end());
+
+    // Only first preference tallies are needed, and these are known
+    // even for contests read from a totals file (with no ballots).
     Ints tallies1(ctest.ncandidates, 0);
-    ComputeTallies(ctest, Ints(), tallies1);
+    for(int i = 0; i < ctest.ncandidates; ++i){
+        tallies1[i] = ctest.cands[i].total_votes;
+    }
 
     double winner_tally = 0;
     for(SInts::const_iterator it = ctest.winners.begin();
@@ -790,7 +1173,7 @@ bool form_audits_plurality(const Contest &ctest, const Parameters &params,
                     aspec.type = QSMAJ;
                     aspec.winner = *cit;
                     aspec.loser = -1;
-                    aspec.eliminated = ctest.eliminations;
+                    aspec.eliminated = eliminations;
                     aspec.asn = asn;
                     aspec.margin = margin;
                     aspec.thresh = thresh;
@@ -844,7 +1227,7 @@ bool form_audits_plurality(const Contest &ctest, const Parameters &params,
                         aspec.type = CDIFF;
                         aspec.winner = *cit1;
                         aspec.loser = *cit2;
-                        aspec.eliminated = ctest.eliminations;
+                        aspec.eliminated = eliminations;
                         aspec.asn = asn;
                         aspec.thresh = d;
                         aspec.margin = margin;
@@ -872,11 +1255,77 @@ bool form_audits_plurality(const Contest &ctest, const Parameters &params,
     return auditfailed;
 }
 
+// Recompute the margin and ASN of an assertion formed by an earlier search,
+// against the contest's current ballots. Returns false if the assertion no
+// longer holds, or would require a full recount to check.
+bool RevalidateAudit(const Contest &ctest, const Parameters &params,
+    const map<int,AuditSpec> &initial_viables, const Ints &has_init_viable,
+    const Audits2d &nebs, const Bools2d &has_neb, AuditSpec &spec)
+{
+    if(spec.type == NEB){
+        if(!has_neb[spec.winner][spec.loser])
+            return false;
+
+        spec = nebs[spec.winner][spec.loser];
+        return true;
+    }
+
+    if(spec.type == VIABLE && spec.eliminated.empty() &&
+        has_init_viable[spec.winner] == 1){
+        spec = initial_viables.find(spec.winner)->second;
+        return true;
+    }
+
+    Ints tallies(ctest.ncandidates, 0);
+    int ex = ComputeTallies(ctest, spec.eliminated, tallies);
+
+    double margin = 0;
+    double asn = -1;
+    if(spec.type == VIABLE){
+        asn = EstimateASN_VIABLE(ctest, spec.winner, tallies, ex, params,
+            margin);
+    }
+    else if(spec.type == NONVIABLE){
+        asn = EstimateASN_NONVIABLE(ctest, spec.winner, tallies, ex, params,
+            margin);
+    }
+    else if(spec.type == IRV){
+        if(tallies[spec.winner] <= tallies[spec.loser])
+            return false;
+
+        int neither = params.tot_auditable_ballots - tallies[spec.winner]
+            - tallies[spec.loser];
+        double amean = (tallies[spec.winner] + 0.5*neither)/
+            params.tot_auditable_ballots;
+
+        margin = 2*amean - 1;
+        asn = estimate_sample_size(margin, params);
+    }
+
+    if(asn == -1 || asn >= params.tot_auditable_ballots)
+        return false;
+
+    spec.asn = asn;
+    spec.margin = margin;
+    return true;
+}
+
+// On entry, 'searched' holds the assertions found by the search for an 
+// earlier batch of ballots, if any. These are revalidated against the 
+// current ballots and, if all still hold, they rule out every alternate 
+// outcome as before and no search is made. On exit, 'searched' holds the 
+// assertions on which the outcome now rests (other than those checking the
+// reported winners and delegate allocation).
 bool form_audits_irv(const Contest &ctest, const Parameters &params,
-    bool alglog, double &lowerbound, int &nodesexpanded, Audits &audits)
+    bool alglog, double &lowerbound, int &nodesexpanded, Audits &audits,
+    Audits &searched)
 {
     bool auditfailed = false;
 
+    const CandidateSet winners(ctest.winners.begin(), ctest.winners.end());
+    const CandidateSet eliminations(ctest.eliminations.begin(),
+        ctest.eliminations.end());
+
     // We first need assertions that will check the viability of 
     // the "reportedly viable" candidates. This can either be an
     // assertion that says "candidate c is viable even when no one 
@@ -890,12 +1339,14 @@ bool form_audits_irv(const Contest &ctest, const Parameters &params,
     map<int,AuditSpec> initial_viables;
     Ints has_init_viable(ctest.ncandidates, 0);
              
+    ThreadPool pool(params.threads);
+
     Ints tallies1(ctest.ncandidates, 0);
-    ComputeTallies(ctest, Ints(), tallies1);
+    ComputeTallies(ctest, CandidateSet(), tallies1, &pool);
 
     Ints tallies2(ctest.ncandidates, 0);
-    int ex2 = ComputeTallies(ctest, ctest.eliminations, tallies2);
-    double rem_vote = ctest.rballots.size() - ex2;
+    int ex2 = ComputeTallies(ctest, eliminations, tallies2, &pool);
+    double rem_vote = ctest.num_rballots - ex2;
 
     // Form assertions to test the delegate counts
     // tallies2 -> tallies of viable candidates at the point
@@ -945,7 +1396,7 @@ bool form_audits_irv(const Contest &ctest, const Parameters &params,
             aspec.type = VIABLE;
             aspec.winner = *cit;
             aspec.loser = -1;
-            aspec.eliminated = ctest.eliminations;
+            aspec.eliminated = eliminations;
             aspec.asn = asn2;
             aspec.margin = margin2;
 
@@ -1050,7 +1501,7 @@ bool form_audits_irv(const Contest &ctest, const Parameters &params,
                     aspec.type = QSMAJ;
                     aspec.winner = *cit;
                     aspec.loser = -1;
-                    aspec.eliminated = ctest.eliminations;
+                    aspec.eliminated = eliminations;
                     aspec.asn = asn;
                     aspec.margin = margin;
                     aspec.thresh = thresh;
@@ -1104,7 +1555,7 @@ bool form_audits_irv(const Contest &ctest, const Parameters &params,
                         aspec.type = CDIFF;
                         aspec.winner = *cit1;
                         aspec.loser = *cit2;
-                        aspec.eliminated = ctest.eliminations;
+                        aspec.eliminated = eliminations;
                         aspec.asn = asn;
                         aspec.thresh = d;
                         aspec.margin = margin;
@@ -1135,20 +1586,27 @@ bool form_audits_irv(const Contest &ctest, const Parameters &params,
         cout << "Finding NEB assertions" << endl;
     }
 
-    Bools2d has_neb;
-    Audits2d nebs;
-    for(int i = 0; i < ctest.ncandidates; ++i){
+    // Tallies of all ballots on which j is ranked above i, for every pair.
+    Ints2d neb_tallies;
+    ComputeNEBTallies(ctest, neb_tallies, &pool);
+
+    // Rows of the matrix are independent, and are filled in concurrently.
+    Bools2d has_neb(ctest.ncandidates);
+    Audits2d nebs(ctest.ncandidates);
+    pool.Run(ctest.ncandidates, [&](int i){
         Bools has_neb_i(ctest.ncandidates, false);
         Audits nebs_i(ctest.ncandidates, AuditSpec());
 
         // i's first preferences is equal to cand.total_votes
         const Candidate &c1 = ctest.cands[i];
+        Ints losers;
+        Doubles margins;
         for(int j = 0; j < ctest.ncandidates; ++j){
             if(i == j) continue;
 
             // Compute j's tally including all ballots that 
             // preference j before i
-            int c2_neb = ComputeNEBTally(ctest, j, i);
+            int c2_neb = neb_tallies[j][i];
             int neither = params.tot_auditable_ballots - c2_neb -
                 c1.total_votes;
 
@@ -1161,25 +1619,31 @@ bool form_audits_irv(const Contest &ctest, const Parameters &params,
                 double amean = (c1.total_votes + 0.5*neither)/
                     params.tot_auditable_ballots;
 
-                double margin = 2*amean - 1;
-                int ssize = estimate_sample_size(margin, params);
-
-                if(ssize < params.tot_auditable_ballots && 
-                    ssize != -1){
-                    AuditSpec &spec = nebs_i[j];
-                    spec.winner = i;
-                    spec.loser = j;
-                    spec.type = NEB;
-                    spec.asn = ssize;
-                    spec.margin = margin;
+                losers.push_back(j);
+                margins.push_back(2*amean - 1);
+            }
+        }
 
-                    has_neb_i[j] = true;
-                }
+        // The sample sizes for the row are estimated together.
+        Ints ssizes;
+        estimate_sample_sizes(margins, params, ssizes);
+        for(int k = 0; k < losers.size(); ++k){
+            const int j = losers[k];
+            const int ssize = ssizes[k];
+            if(ssize < params.tot_auditable_ballots && ssize != -1){
+                AuditSpec &spec = nebs_i[j];
+                spec.winner = i;
+                spec.loser = j;
+                spec.type = NEB;
+                spec.asn = ssize;
+                spec.margin = margins[k];
+
+                has_neb_i[j] = true;
             }
         }
-        has_neb.push_back(has_neb_i);
-        nebs.push_back(nebs_i);
-    }
+        has_neb[i] = has_neb_i;
+        nebs[i] = nebs_i;
+    });
 
     if(alglog){
         cout << "Starting lower bound on ASN: " <<
@@ -1188,7 +1652,46 @@ bool form_audits_irv(const Contest &ctest, const Parameters &params,
             << "%)" << endl;
     }
 
+    if(!searched.empty()){
+        bool valid = true;
+        for(int i = 0; i < searched.size() && valid; ++i){
+            valid = RevalidateAudit(ctest, params, initial_viables,
+                has_init_viable, nebs, has_neb, searched[i]);
+        }
+
+        if(valid){
+            for(int i = 0; i < searched.size(); ++i){
+                if(!AuditExists(searched[i], audits)){
+                    audits.push_back(searched[i]);
+                }
+                lowerbound = max(lowerbound, searched[i].asn);
+            }
+
+            if(alglog){
+                cout << searched.size() << " assertions from the previous " 
+                    << "search still hold, no search required" << endl;
+            }
+            return auditfailed;
+        }
+
+        if(alglog){
+            cout << "Assertions from the previous search no longer hold, "
+                << "searching again" << endl;
+        }
+        searched.clear();
+    }
+
     Frontier front;
+    TallyCache tcache(ctest, &pool, params.tally_table_mb);
+    if(alglog && params.tally_table_mb > 0){
+        if(tcache.table.empty()){
+            cout << "Tally table would exceed " << params.tally_table_mb
+                << " MB, tallying ballots instead" << endl;
+        }
+        else{
+            cout << "Tally table: " << tcache.table.MB() << " MB" << endl;
+        }
+    }
 
     // Build initial frontier by forming all 2^n (where n is the
     // number of candidates) subsets of candidates to represent 
@@ -1224,7 +1727,7 @@ bool form_audits_irv(const Contest &ctest, const Parameters &params,
         if(newn.head.empty())
             continue;
 
-        if(newn.head == ctest.winners)
+        if(newn.head == winners)
             continue;
 
         newn.best_audit.asn = -1;
@@ -1237,7 +1740,7 @@ bool form_audits_irv(const Contest &ctest, const Parameters &params,
         GetTime(&t1);
 
         newn.estimate = FindBestAudit(ctest, params, newn, 
-            initial_viables,has_init_viable,nebs,has_neb,alglog);
+            initial_viables,has_init_viable,nebs,has_neb,tcache,alglog);
 
         mytimespec t2;
         GetTime(&t2);
@@ -1248,6 +1751,9 @@ bool form_audits_irv(const Contest &ctest, const Parameters &params,
             if(!AuditExists(newn.best_audit, audits)){
                 audits.push_back(newn.best_audit);
             }
+            if(!AuditExists(newn.best_audit, searched)){
+                searched.push_back(newn.best_audit);
+            }
 
             pruned += 1;
             continue;
@@ -1255,7 +1761,7 @@ bool form_audits_irv(const Contest &ctest, const Parameters &params,
 
         if(alglog){
             cout << "Added node [ ";
-            for(SInts::const_iterator it = newn.head.begin();
+            for(CandidateSet::const_iterator it = newn.head.begin();
                 it != newn.head.end(); ++it)
                 cout << ctest.cands[*it].id << " ";
             cout << "] with estimate " << newn.estimate
@@ -1324,7 +1830,7 @@ bool form_audits_irv(const Contest &ctest, const Parameters &params,
         if(params.diving){
             double divelb = PerformDive(toexpand, ctest, 
                 initial_viables, has_init_viable, nebs,
-                has_neb, params);
+                has_neb, params, tcache);
             if(divelb == -1){
                 // Audit not possible
                 if(alglog){
@@ -1368,13 +1874,20 @@ bool form_audits_irv(const Contest &ctest, const Parameters &params,
             cout << endl;
         }
 
+        // The children of toexpand each restore one of its unmentioned 
+        // candidates, so their tallies are all derived from its own.
+        CandidateSet unmentioned = 
+            CandidateSet::Range(ctest.ncandidates) - toexpand.head;
+        for(int i = 0; i < toexpand.tail.size(); ++i){
+            unmentioned.erase(toexpand.tail[i]);
+        }
+        tcache.Expand(unmentioned);
+
         // For each candidate 'c' not in toexpand.tail or 
         // toexpand.head, create a new node with 
         // node.tail = [c] ++ toexpand.tail
         for(int i = 0; i < ctest.ncandidates; ++i){
-            if(find(toexpand.tail.begin(),toexpand.tail.end(),i) ==
-                toexpand.tail.end() && toexpand.head.find(i) == 
-                toexpand.head.end()){
+            if(!toexpand.tail.contains(i) && !toexpand.head.contains(i)){
         
                 Node newn;
                 newn.head = toexpand.head;
@@ -1395,7 +1908,7 @@ bool form_audits_irv(const Contest &ctest, const Parameters &params,
                         cout << ctest.cands[newn.tail[i]].id << " ";
                     }
                     cout << "( ";
-                    for(SInts::const_iterator cit=newn.head.begin();
+                    for(CandidateSet::const_iterator cit=newn.head.begin();
                         cit != newn.head.end(); ++cit){
                         cout << ctest.cands[*cit].id << " ";
                     }
@@ -1422,7 +1935,7 @@ bool form_audits_irv(const Contest &ctest, const Parameters &params,
                 newn.has_ancestor = true;
                 newn.estimate = FindBestAudit(ctest, params, newn, 
                     initial_viables, has_init_viable, nebs, 
-                    has_neb, alglog);
+                    has_neb, tcache, alglog);
 
                 if(alglog){
                     cout << newn.estimate << endl;
@@ -1491,8 +2004,14 @@ bool form_audits_irv(const Contest &ctest, const Parameters &params,
         }
     }
 
+    if(alglog){
+        cout << "Tally cache: " << tcache.hits << " hits, " << tcache.misses
+            << " misses" << endl;
+    }
+
     if(auditfailed){
         audits.clear();
+        searched.clear();
     }
     else{
         for(Frontier::const_iterator it = front.begin(); 
@@ -1500,6 +2019,9 @@ bool form_audits_irv(const Contest &ctest, const Parameters &params,
             if(!AuditExists(it->best_audit, audits)){
                 audits.push_back(it->best_audit);
             }
+            if(!AuditExists(it->best_audit, searched)){
+                searched.push_back(it->best_audit);
+            }
         }
     }
 
@@ -1507,11 +2029,269 @@ bool form_audits_irv(const Contest &ctest, const Parameters &params,
 }
 
 
+// Generate an audit for each contest, printing the assertions required and
+// a summary of the results. The assertions to check for each contest (empty
+// where a full recount is required) are added to audits_to_run. For IRV 
+// contests, searched[k] carries the assertions found by the search for 
+// contest k from one call to the next (see form_audits_irv).
+void AuditContests(const Contests &contests, const Parameters &params,
+    bool is_plurality, bool alglog, Audits2d &searched,
+    vector<Audits> &audits_to_run)
+{
+    ThreadPool pool(params.threads);
+
+    Ints successes;
+    Ints full_recounts;
+
+    // NOTE: asn's are defined in ballots, not proportions/percentages
+    double overall_asn_ballots = -1;
+    double overall_asn_werror = -1;
+
+    // With more than one risk limit, audits are generated at the first
+    // (smallest), and the sample sizes of their assertions are also 
+    // reported at each of the others.
+    const int nrisks = params.risk_limits.size();
+    Doubles overall_asn_by_risk(nrisks, -1);
+
+    // When validating the approximate sample sizes with errors: the number
+    // compared, the sum and maximum of their relative deviations from the
+    // simulated sizes, and the number where only one is -1.
+    int nvalidated = 0;
+    double sum_deviation = 0;
+    double max_deviation = 0;
+    int ndisagree = 0;
+
+    for(int k = 0; k < contests.size(); ++k){
+        const Contest &ctest = contests[k];
+        if(alglog){
+            cout << "GENERATING AUDIT FOR CONTEST " << ctest.id << endl;
+        }
+        mytimespec tstart;
+        GetTime(&tstart);
+
+        // List of audits to complete.
+        Audits audits;
+        double lowerbound = -10;
+        bool auditfailed = false;
+
+        int nodesexpanded = 0;
+
+        if(is_plurality){
+            auditfailed=form_audits_plurality(ctest, params, alglog, 
+                lowerbound, nodesexpanded, audits);
+
+        }
+        else{
+            auditfailed = form_audits_irv(ctest, params, alglog, 
+                lowerbound, nodesexpanded, audits, searched[k]);
+
+        }
+
+        if(auditfailed){
+            audits_to_run.push_back(Audits());
+            full_recounts.push_back(ctest.id);
+            continue;
+        }
+        
+        mytimespec tend;
+        GetTime(&tend);
+
+        double maxasn = -1;
+        double maxasn_we = 0;
+        Doubles maxasn_by_risk(nrisks, 0);
+        if(!auditfailed){
+            cout << "=========================================" << endl;
+            cout << "AUDITS REQUIRED" << endl;
+            maxasn = 0;
+            Audits final_config;
+
+            // Sort audits from largest to smallest ASN
+            sort(audits.begin(), audits.end(), RevCompareAudit);
+
+            for(Audits::const_iterator it = audits.begin(); 
+                it != audits.end();++it){
+                bool subsumed = false;
+                for(Audits::const_iterator jt = audits.begin(); 
+                    jt != audits.end(); ++jt){
+                    if(jt == it) continue;
+                    if(Subsumes(*jt, *it)){
+                        subsumed = true;
+                    
+                        break;
+                    }
+                }
+                if(!subsumed){
+                    final_config.push_back(*it);
+                    PrintAudit(*it, ctest.cands);
+                    maxasn = max(maxasn, it->asn);
+
+                    if(nrisks > 1){
+                        Ints asns;
+                        estimate_sample_size_multi(it->margin, params, 
+                            params.risk_limits, asns);
+                        for(int r = 0; r < nrisks; ++r){
+                            if(asns[r] == -1 || maxasn_by_risk[r] == -1)
+                                maxasn_by_risk[r] = -1;
+                            else
+                                maxasn_by_risk[r] = max(maxasn_by_risk[r],
+                                    (double)asns[r]);
+                        }
+                    }
+
+                    double asn_we = (params.error_asn == ERRASN_APPROX) ?
+                        estimate_sample_size_e(it->margin, params) :
+                        estimate_sample_size_x(it->margin, params, ctest.id,
+                        final_config.size(), &pool);
+
+                    if(params.error_asn == ERRASN_VALIDATE){
+                        double approx = estimate_sample_size_e(it->margin,
+                            params);
+                        cout << "ERRASN," << ctest.id << "," << it->margin
+                            << "," << asn_we << "," << approx << endl;
+
+                        if((asn_we == -1) != (approx == -1)){
+                            ++ndisagree;
+                        }
+                        else if(asn_we != -1){
+                            double dev = fabs(approx - asn_we)/asn_we;
+                            ++nvalidated;
+                            sum_deviation += dev;
+                            max_deviation = max(max_deviation, dev);
+                        }
+                    }
+
+                    if(maxasn_we == -1)
+                        continue;
+                    else{
+                        if(asn_we == -1)
+                            maxasn_we = -1;
+                        else{
+                            maxasn_we = max(maxasn_we, asn_we);
+                        }
+                    }
+                }
+            }
+            double in_pc = (maxasn/params.tot_auditable_ballots)*100;
+            double in_pc_we=(maxasn_we/params.tot_auditable_ballots)*100;
+           
+            cout << final_config.size() << " assertions" << endl; 
+            cout << "MAX ASN(%) " << in_pc << ", with " << 
+                params.error_rate << " error," << in_pc_we << endl;
+            for(int r = 0; r < nrisks && nrisks > 1; ++r){
+                cout << "RISK LIMIT," << params.risk_limits[r] << 
+                    ",MAX ASN(%)," << (maxasn_by_risk[r]/
+                    params.tot_auditable_ballots)*100 << endl;
+            }
+            cout << "=========================================" << endl;
+
+            if(maxasn >= params.tot_auditable_ballots){
+                full_recounts.push_back(ctest.id);
+                audits_to_run.push_back(Audits());
+            }
+            else{
+                audits_to_run.push_back(final_config);
+                successes.push_back(ctest.id);
+                overall_asn_ballots = max(overall_asn_ballots,maxasn);
+                overall_asn_werror = max(overall_asn_werror,maxasn_we);
+                for(int r = 0; r < nrisks; ++r){
+                    overall_asn_by_risk[r] = max(overall_asn_by_risk[r],
+                        maxasn_by_risk[r]);
+                }
+            }
+        }
+        else{
+            if(alglog){
+                cout << endl;
+                cout << "AUDIT NOT POSSIBLE" <<endl;
+            }   
+            audits_to_run.push_back(Audits());
+            full_recounts.push_back(ctest.id);
+        }
+        double in_pc = (maxasn/params.tot_auditable_ballots)*100;
+        double in_pc_we = (maxasn_we/params.tot_auditable_ballots)*100;
+        cout << "TIME," << tend.seconds - tstart.seconds << 
+            ",Nodes Expanded," << nodesexpanded << ",MAX ASN(%)," << 
+            in_pc  << ", with " << params.error_rate << " error," << 
+            in_pc_we << endl;
+    }
+
+    cout << "============================================" << endl;
+    cout << "SUMMARY" << endl;
+    if(successes.size() > 0){
+        cout << "Audit found for contests: ";
+        for(int i = 0; i < successes.size(); ++i){
+            cout << successes[i] << " ";
+        }
+        cout << endl;
+        cout << "EST," << overall_asn_ballots << "," 
+            << overall_asn_werror << endl;
+        for(int r = 0; r < nrisks && nrisks > 1; ++r){
+            cout << "EST AT RISK LIMIT," << params.risk_limits[r] << "," <<
+                overall_asn_by_risk[r] << endl;
+        }
+    }
+    if(params.error_asn == ERRASN_VALIDATE){
+        cout << "ERRASN VALIDATION,Compared," << nvalidated << 
+            ",Mean deviation(%)," << ((nvalidated > 0) ? 
+            100*sum_deviation/nvalidated : 0) << ",Max deviation(%)," <<
+            100*max_deviation << ",Disagree on -1," << ndisagree << endl;
+    }
+    if(full_recounts.size() > 0){
+        cout << "Full recounts required for contests: ";
+        for(int i = 0; i < full_recounts.size(); ++i){
+            cout << full_recounts[i] << " ";
+        }
+        cout << endl;
+    }
+    cout << "============================================" << endl;
+}
+
+
+// Output the audits, generated at the smallest of several risk limits, once
+// for each risk limit, with the sample sizes required at that risk limit.
+// The file for risk limit r is json_file with "_r<r>" added before its 
+// extension.
+void OutputToJSONAtRiskLimits(const Contests &contests, 
+    const vector<Audits> &torun, const Parameters &params, 
+    const char *json_file)
+{
+    const string path(json_file);
+    const size_t dot = path.find_last_of('.');
+    const size_t slash = path.find_last_of("/\\");
+    const bool has_ext = dot != string::npos && 
+        (slash == string::npos || dot > slash);
+    const string stem = has_ext ? path.substr(0, dot) : path;
+    const string ext = has_ext ? path.substr(dot) : "";
+
+    for(int r = 0; r < params.risk_limits.size(); ++r){
+        Parameters rparams(params);
+        rparams.risk_limit = params.risk_limits[r];
+
+        vector<Audits> rtorun(torun);
+        for(int k = 0; k < rtorun.size(); ++k){
+            for(int i = 0; i < rtorun[k].size(); ++i){
+                AuditSpec &spec = rtorun[k][i];
+                spec.asn = estimate_sample_size(spec.margin, rparams);
+            }
+        }
+
+        stringstream ss;
+        ss << stem << "_r" << rparams.risk_limit << ext;
+        OutputToJSON(contests, rtorun, rparams, ss.str().c_str());
+    }
+}
+
+
 /**
  * Summary of command line options:
  *
  * -rep_ballots FILE     File containing reported ballots (electronic records)
  *
+ * -rep_totals FILE      File containing reported first preference totals for
+ *                          a single contest (in place of -rep_ballots). Only
+ *                          for use with -plurality. Each vote is counted as
+ *                          one auditable ballot.
+ *
  * -agap VALUE           This program finds a set of facts that require the 
  *                          least number of anticipated ballot polls to audit
  *                          (via a comparison audit). The implemented algorithm
@@ -1522,6 +2302,14 @@ bool form_audits_irv(const Contest &ctest, const Parameters &params,
  *                          is less than (or equal to) agap. 
  *
  * -r VALUE              Risk limit (e.g., 0.05 represents a risk limit of 5%)
+ *                          A comma separated list of risk limits (e.g., 
+ *                          0.01,0.05,0.10) may be given. Audits are then 
+ *                          generated once, at the smallest, and are valid at
+ *                          all of them. The sample sizes required at each 
+ *                          risk limit are found from one martingale trajectory
+ *                          per assertion, and reported. The json output is 
+ *                          written once per risk limit, to FILE with "_r" and
+ *                          the risk limit added before its extension.
  *
  * -alglog               If present, log messages designed to indicate how the
  *                          algorithm is progressing will be printed.
@@ -1535,6 +2323,55 @@ bool form_audits_irv(const Contest &ctest, const Parameters &params,
  *                          those contests. IF NOT PRESENT, ASSUME ALL
  *                          CONTESTS MENTIONED IN INPUT WILL BE AUDITED.  
  * 
+ * -cache                Keep a binary cache of the reported ballots next to
+ *                          the ballots file (FILE.cache). The cache is written
+ *                          the first time the file is read, and memory mapped
+ *                          in place of parsing the file on later runs. Only 
+ *                          used when all contests are audited.
+ *
+ * -exact_ids            Count distinct ballot ids exactly. By default ids are
+ *                          counted by 64-bit fingerprint, which could merge
+ *                          two ids in the (very unlikely) event of a 
+ *                          fingerprint collision.
+ *
+ * -add_ballots FILE     A further batch of reported ballots (for example, those
+ *                          of one county), in the same format as -rep_ballots.
+ *                          May be given more than once. Once audits have been
+ *                          generated, each batch in turn is added to the 
+ *                          ballots already loaded and the audits are revised.
+ *                          Where the assertions found by an earlier search 
+ *                          still hold, they are kept without a new search. 
+ *                          The json output describes the final audits.
+ *
+ * -tally_table MB       For IRV contests with few candidates, compute the 
+ *                          tallies for every set of eliminated candidates once,
+ *                          before the search, if these fit in MB megabytes 
+ *                          (about 4(n+1)2^n bytes for n candidates). Otherwise,
+ *                          tallies are computed from the ballots as needed.
+ *
+ * -error_asn MODE       How the sample sizes with errors (at -error_rate) are
+ *                          estimated. MODE is 'sim' (the default), to take the
+ *                          median over -reps simulated samples, 'approx', to 
+ *                          use an analytical approximation to that median, or
+ *                          'validate', to simulate and also print, for each 
+ *                          assertion, the approximation and then a summary of
+ *                          how far the approximations deviate.
+ *
+ * -asn_memo FILE        Keep the sample sizes estimated for each margin in 
+ *                          FILE. Sizes memoised by an earlier run are read
+ *                          from FILE, if it exists, and all are written back
+ *                          at the end. Sizes depend on the margin, risk limit,
+ *                          martingale parameters and number of ballots, so 
+ *                          the file may be shared by runs over different 
+ *                          contests or with different settings.
+ *
+ * -threads N            Number of threads to use. Reported ballots are parsed
+ *                          in parallel, in line aligned chunks, when N > 1.
+ *                          IRV tallies over large sets of ballots, the 
+ *                          matrix of NEB assertions, and the replicates of
+ *                          sample sizes with errors, are also computed in 
+ *                          parallel. Results do not depend on N.
+ *
  * -help                 Print usage instructions.     
  * */
 
@@ -1552,21 +2389,30 @@ int main(int argc, const char * argv[])
 
         Parameters params;
         params.risk_limit = 0.05;
+        params.risk_limits.assign(1, params.risk_limit);
         params.tot_auditable_ballots = 0;
         params.t = 0.5;
         params.g = 0.1;
         params.error_rate = 0.002;
         params.seed = 930803205229070;
         params.reps = 20;
+        params.error_asn = ERRASN_SIMULATE;
         params.level = 0;
 
         params.diving = true;
+        params.threads = 1;
+        params.tally_table_mb = 0;
 
         bool is_plurality = false;
+        bool use_cache = false;
+        bool exact_ids = false;
 
         const char *rep_blts_file = NULL;
+        const char *rep_totals_file = NULL;
         const char *rep_outc_file = NULL;
         const char *json_output = NULL;
+        const char *asn_memo_file = NULL;
+        vector<const char*> batch_files;
 
         params.allowed_gap = 0;
         double threshold_pc = 0.15;
@@ -1586,6 +2432,14 @@ int main(int argc, const char * argv[])
                 rep_blts_file = argv[i+1];
                 ++i;
             }
+            else if(strcmp(argv[i], "-add_ballots") == 0 && i < argc-1){
+                batch_files.push_back(argv[i+1]);
+                ++i;
+            }
+            else if(strcmp(argv[i], "-rep_totals") == 0 && i < argc-1){
+                rep_totals_file = argv[i+1];
+                ++i;
+            }
             else if(strcmp(argv[i], "-rep_outcome") == 0 && i < argc-1){
                 rep_outc_file = argv[i+1];
                 ++i;
@@ -1603,13 +2457,46 @@ int main(int argc, const char * argv[])
                 ++i;
             }
             else if(strcmp(argv[i], "-r") == 0 && i < argc-1){
-                params.risk_limit = atof(argv[i+1]);
+                Strings values;
+                boost::split(values, argv[i+1], boost::is_any_of(","));
+                params.risk_limits.clear();
+                for(int j = 0; j < values.size(); ++j){
+                    params.risk_limits.push_back(atof(values[j].c_str()));
+                }
                 ++i;
             }
             else if(strcmp(argv[i], "-reps") == 0 && i < argc-1){
                 params.reps = atoi(argv[i+1]);
                 ++i;
             }
+            else if(strcmp(argv[i], "-threads") == 0 && i < argc-1){
+                params.threads = max(1, atoi(argv[i+1]));
+                ++i;
+            }
+            else if(strcmp(argv[i], "-error_asn") == 0 && i < argc-1){
+                if(strcmp(argv[i+1], "sim") == 0){
+                    params.error_asn = ERRASN_SIMULATE;
+                }
+                else if(strcmp(argv[i+1], "approx") == 0){
+                    params.error_asn = ERRASN_APPROX;
+                }
+                else if(strcmp(argv[i+1], "validate") == 0){
+                    params.error_asn = ERRASN_VALIDATE;
+                }
+                else{
+                    cout << "Unknown -error_asn mode " << argv[i+1] << endl;
+                    return 1;
+                }
+                ++i;
+            }
+            else if(strcmp(argv[i], "-asn_memo") == 0 && i < argc-1){
+                asn_memo_file = argv[i+1];
+                ++i;
+            }
+            else if(strcmp(argv[i], "-tally_table") == 0 && i < argc-1){
+                params.tally_table_mb = atof(argv[i+1]);
+                ++i;
+            }
             else if(strcmp(argv[i], "-level") == 0 && i < argc-1){
                 params.level = atoi(argv[i+1]);
                 ++i;
@@ -1617,6 +2504,12 @@ int main(int argc, const char * argv[])
             else if(strcmp(argv[i], "-plurality") == 0){
                 is_plurality = true;
             }
+            else if(strcmp(argv[i], "-exact_ids") == 0){
+                exact_ids = true;
+            }
+            else if(strcmp(argv[i], "-cache") == 0){
+                use_cache = true;
+            }
             else if(strcmp(argv[i], "-alglog") == 0){
                 alglog = true;
             }
@@ -1636,38 +2529,113 @@ int main(int argc, const char * argv[])
                     Contest newc;
                     newc.id = con_id;
                     newc.num_rballots = 0;
+                    newc.ncandidates = 0;
                     contests.push_back(newc);        
                 }
                 i += 1 + numc;
             }
         }
 
-        if(rep_blts_file == NULL || (!is_plurality && rep_outc_file == NULL)){
+        sort(params.risk_limits.begin(), params.risk_limits.end());
+        params.risk_limits.erase(unique(params.risk_limits.begin(),
+            params.risk_limits.end()), params.risk_limits.end());
+        params.risk_limit = params.risk_limits[0];
+
+        if((rep_blts_file == NULL && rep_totals_file == NULL) || 
+            (!is_plurality && rep_outc_file == NULL)){
             cout << "Reported ballots or outcome not provided." << endl;
             return 1;
         }
 
-        set<string> ballot_ids;
-        if(!ReadReportedBallots(rep_blts_file, contests, contest_id2index,
-            ballot_ids, params)){
-            cout << "Reported ballots read error. Exiting." << endl;
+        if(rep_totals_file != NULL && (rep_blts_file != NULL || 
+            !is_plurality)){
+            cout << "Reported totals can only be used, in place of " <<
+                "reported ballots, for plurality audits." << endl;
+            return 1;
+        }
+
+        if(!batch_files.empty() && rep_blts_file == NULL){
+            cout << "Batches of ballots can only be added to reported " <<
+                "ballots." << endl;
             return 1;
         }
 
-        params.tot_auditable_ballots = ballot_ids.size();
+        mytimespec tread1;
+        GetTime(&tread1);
+
+        // The ballot cache describes every contest in the reported 
+        // ballots file, and so is only used when all contests are audited.
+        string cache_file = (rep_blts_file == NULL) ? "" : 
+            string(rep_blts_file) + ".cache";
+        use_cache = use_cache && contests.empty();
+
+        // Ids of ballots that have been read from a reported ballots file,
+        // rather than loaded from a cache, and of any later batches.
+        BallotIDSet ballot_ids(exact_ids);
+
+        int nballot_ids = 0;
+        if(rep_totals_file != NULL){
+            if(!ReadReportedTotals(rep_totals_file, contests, 
+                contest_id2index, nballot_ids)){
+                cout << "Reported totals read error. Exiting." << endl;
+                return 1;
+            }
+
+            if(alglog){
+                mytimespec tread2;
+                GetTime(&tread2);
+                cout << "Read totals for " << nballot_ids << " ballots in " <<
+                    tread2.seconds - tread1.seconds << "s" << endl;
+            }
+        }
+        else if(use_cache && ReadBallotCache(cache_file.c_str(), 
+            rep_blts_file, contests, contest_id2index, nballot_ids)){
+            if(alglog){
+                mytimespec tread2;
+                GetTime(&tread2);
+                cout << "Loaded ballot cache " << cache_file << " in " <<
+                    tread2.seconds - tread1.seconds << "s" << endl;
+            }
+        }
+        else{
+            if(!ReadReportedBallots(rep_blts_file, contests, 
+                contest_id2index, ballot_ids, params)){
+                cout << "Reported ballots read error. Exiting." << endl;
+                return 1;
+            }
+            nballot_ids = ballot_ids.size();
+
+            if(alglog){
+                mytimespec tread2;
+                GetTime(&tread2);
+
+                double mbytes=boost::filesystem::file_size(rep_blts_file)/1E6;
+                double secs = tread2.seconds - tread1.seconds;
+                cout << "Read " << mbytes << " MB of reported ballots in " <<
+                    secs << "s (" << ((secs > 0) ? mbytes/secs : 0) <<
+                    " MB/s)" << endl;
+                cout << "Ballot id registry: " << nballot_ids << " ids, " <<
+                    ballot_ids.MemoryUsage()/1E6 << " MB (std::set<string> "
+                    "estimate " << ballot_ids.StringSetMemoryUsage()/1E6 <<
+                    " MB)" << endl;
+            }
+
+            if(use_cache && !WriteBallotCache(cache_file.c_str(), 
+                rep_blts_file, contests, nballot_ids)){
+                cout << "Could not write ballot cache " << cache_file << 
+                    endl;
+            }
+        }
+
+        params.tot_auditable_ballots = nballot_ids;
 
         // Express allowed gap in ballots rather than as a fraction of ballots
+        const double allowed_gap_fr = params.allowed_gap;
         params.allowed_gap *= params.tot_auditable_ballots;       
         
         for(int i = 0; i < contests.size(); ++i){
             Contest &ctest = contests[i];
-            for(int j = 0; j < ctest.rballots.size(); ++j){
-                const Ballot &bt = ctest.rballots[j];
-                if(bt.prefs.empty())
-                    continue;
-                ctest.cands[bt.prefs[0]].ballots.push_back(j);
-            }
-            ctest.threshold = floor(threshold_pc*ctest.rballots.size() + 1);
+            ctest.threshold = floor(threshold_pc*ctest.num_rballots + 1);
             ctest.threshold_fr = threshold_pc;
             if(alglog){
                 cout << "Threshold (contest " << ctest.id << "): " 
@@ -1681,148 +2649,73 @@ int main(int argc, const char * argv[])
         }
 
 
-        Ints successes;
-        Ints full_recounts;
+        if(asn_memo_file != NULL && boost::filesystem::exists(asn_memo_file)
+            && !ReadASNMemo(asn_memo_file)){
+            cout << "Could not read sample size memo " << asn_memo_file <<
+                endl;
+        }
 
-        // NOTE: asn's are defined in ballots, not proportions/percentages
-        double overall_asn_ballots = -1;
-        double overall_asn_werror = -1;
-    
-        mt19937_64 gen(params.seed);
-        for(int k = 0; k < contests.size(); ++k){
-            const Contest &ctest = contests[k];
-            if(alglog){
-                cout << "GENERATING AUDIT FOR CONTEST " << ctest.id << endl;
+        Audits2d searched(contests.size());
+        AuditContests(contests, params, is_plurality, alglog, searched,
+            audits_to_run);
+
+        // Each batch of ballots is added to those already loaded, and the
+        // audits are revised. Ballot ids not already in the registry (those
+        // loaded from a cache) are taken to be distinct from those in the 
+        // batches.
+        const int unregistered_ids = nballot_ids - ballot_ids.size();
+        for(int b = 0; b < batch_files.size(); ++b){
+            mytimespec tbatch1;
+            GetTime(&tbatch1);
+
+            if(!AppendReportedBallots(batch_files[b], contests, 
+                contest_id2index, ballot_ids, params)){
+                cout << "Ballot batch read error. Exiting." << endl;
+                return 1;
             }
-            mytimespec tstart;
-            GetTime(&tstart);
-
-            // List of audits to complete.
-            Audits audits;
-            double lowerbound = -10;
-            bool auditfailed = false;
-
-            int nodesexpanded = 0;
 
-            if(is_plurality){
-                auditfailed=form_audits_plurality(ctest, params, alglog, 
-                    lowerbound, nodesexpanded, audits);
+            nballot_ids = unregistered_ids + ballot_ids.size();
+            params.tot_auditable_ballots = nballot_ids;
+            params.allowed_gap = allowed_gap_fr*nballot_ids;
 
+            for(int i = 0; i < contests.size(); ++i){
+                Contest &ctest = contests[i];
+                ctest.threshold = floor(threshold_pc*ctest.num_rballots + 1);
             }
-            else{
-                auditfailed = form_audits_irv(ctest, params, alglog, 
-                    lowerbound, nodesexpanded, audits);
 
-            }
+            mytimespec tbatch2;
+            GetTime(&tbatch2);
 
-            if(auditfailed){
-                audits_to_run.push_back(Audits());
-                full_recounts.push_back(ctest.id);
-                continue;
+            cout << "BATCH," << batch_files[b] << ",Ballots," << 
+                nballot_ids << endl;
+            if(alglog){
+                cout << "Added batch in " << tbatch2.seconds - 
+                    tbatch1.seconds << "s" << endl;
             }
-            
-            mytimespec tend;
-            GetTime(&tend);
-
-            double maxasn = -1;
-            double maxasn_we = 0;
-            if(!auditfailed){
-                cout << "=========================================" << endl;
-                cout << "AUDITS REQUIRED" << endl;
-                maxasn = 0;
-                Audits final_config;
-
-                // Sort audits from largest to smallest ASN
-                sort(audits.begin(), audits.end(), RevCompareAudit);
-
-                for(Audits::const_iterator it = audits.begin(); 
-                    it != audits.end();++it){
-                    bool subsumed = false;
-                    for(Audits::const_iterator jt = audits.begin(); 
-                        jt != audits.end(); ++jt){
-                        if(jt == it) continue;
-                        if(Subsumes(*jt, *it)){
-                            subsumed = true;
-                        
-                            break;
-                        }
-                    }
-                    if(!subsumed){
-                        final_config.push_back(*it);
-                        PrintAudit(*it, ctest.cands);
-                        maxasn = max(maxasn, it->asn);
 
-                        double asn_we = estimate_sample_size_x(
-                            it->margin, params, gen);
-
-                        if(maxasn_we == -1)
-                            continue;
-                        else{
-                            if(asn_we == -1)
-                                maxasn_we = -1;
-                            else{
-                                maxasn_we = max(maxasn_we, asn_we);
-                            }
-                        }
-                    }
-                }
-                double in_pc = (maxasn/params.tot_auditable_ballots)*100;
-                double in_pc_we=(maxasn_we/params.tot_auditable_ballots)*100;
-               
-                cout << final_config.size() << " assertions" << endl; 
-                cout << "MAX ASN(%) " << in_pc << ", with " << 
-                    params.error_rate << " error," << in_pc_we << endl;
-                cout << "=========================================" << endl;
-
-                if(maxasn >= params.tot_auditable_ballots){
-                    full_recounts.push_back(ctest.id);
-                    audits_to_run.push_back(Audits());
-                }
-                else{
-                    audits_to_run.push_back(final_config);
-                    successes.push_back(ctest.id);
-                    overall_asn_ballots = max(overall_asn_ballots,maxasn);
-                    overall_asn_werror = max(overall_asn_werror,maxasn_we);
-                }
-            }
-            else{
-                if(alglog){
-                    cout << endl;
-                    cout << "AUDIT NOT POSSIBLE" <<endl;
-                }   
-                audits_to_run.push_back(Audits());
-                full_recounts.push_back(ctest.id);
-            }
-            double in_pc = (maxasn/params.tot_auditable_ballots)*100;
-            double in_pc_we = (maxasn_we/params.tot_auditable_ballots)*100;
-            cout << "TIME," << tend.seconds - tstart.seconds << 
-                ",Nodes Expanded," << nodesexpanded << ",MAX ASN(%)," << 
-                in_pc  << ", with " << params.error_rate << " error," << 
-                in_pc_we << endl;
+            audits_to_run.clear();
+            AuditContests(contests, params, is_plurality, alglog, 
+                searched, audits_to_run);
         }
 
-        cout << "============================================" << endl;
-        cout << "SUMMARY" << endl;
-        if(successes.size() > 0){
-            cout << "Audit found for contests: ";
-            for(int i = 0; i < successes.size(); ++i){
-                cout << successes[i] << " ";
-            }
-            cout << endl;
-            cout << "EST," << overall_asn_ballots << "," 
-                << overall_asn_werror << endl;
+        if(json_output != NULL && params.risk_limits.size() == 1){
+            OutputToJSON(contests, audits_to_run, params, json_output);
         }
-        if(full_recounts.size() > 0){
-            cout << "Full recounts required for contests: ";
-            for(int i = 0; i < full_recounts.size(); ++i){
-                cout << full_recounts[i] << " ";
-            }
-            cout << endl;
+        else if(json_output != NULL){
+            OutputToJSONAtRiskLimits(contests, audits_to_run, params, 
+                json_output);
         }
-        cout << "============================================" << endl;
 
-        if(json_output != NULL){
-            OutputToJSON(contests, audits_to_run, params, json_output);
+        if(alglog){
+            long hits = 0, misses = 0, entries = 0;
+            GetASNMemoStats(hits, misses, entries);
+            cout << "ASN memo: " << hits << " hits, " << misses << 
+                " misses, " << entries << " entries" << endl;
+        }
+
+        if(asn_memo_file != NULL && !WriteASNMemo(asn_memo_file)){
+            cout << "Could not write sample size memo " << asn_memo_file <<
+                endl;
         }
     }
     catch(exception &e)
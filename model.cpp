@@ -27,6 +27,24 @@
 #include<stdexcept>
 #include<string>
 #include<array>
+#include<cstring>
+#include<climits>
+#include<stdint.h>
+
+#ifndef _WIN32
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<fcntl.h>
+#include<unistd.h>
+#else
+#include<process.h>
+#define getpid _getpid
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define X86_HISTOGRAM_KERNELS
+#include<immintrin.h>
+#endif
 
 #include "model.h"
 
@@ -119,30 +137,794 @@ void Split(const string &line, const boostcharsep &sep, vector<string> &r)
 }
 
 
+bool MappedFile::Open(const char *path)
+{
+	Close();
+
+	#ifndef _WIN32
+	int fd = open(path, O_RDONLY);
+	if(fd == -1)
+		return false;
+
+	struct stat st;
+	if(fstat(fd, &st) == -1){
+		close(fd);
+		return false;
+	}
+
+	length = st.st_size;
+	if(length > 0){
+		void *addr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(addr != MAP_FAILED){
+			madvise(addr, length, MADV_SEQUENTIAL);
+			data = (const char*)addr;
+			mapped = true;
+			close(fd);
+			return true;
+		}
+	}
+	close(fd);
+	#endif
+
+	// Fall back to reading the whole file into memory.
+	ifstream infile(path, ios::in | ios::binary);
+	if(!infile)
+		return false;
+
+	buffer.assign(istreambuf_iterator<char>(infile), 
+		istreambuf_iterator<char>());
+	data = buffer.empty() ? NULL : &buffer[0];
+	length = buffer.size();
+	return true;
+}
+
+void MappedFile::Close()
+{
+	#ifndef _WIN32
+	if(mapped){
+		munmap((void*)data, length);
+	}
+	#endif
+
+	buffer.clear();
+	data = NULL;
+	length = 0;
+	mapped = false;
+}
+
+ThreadPool::ThreadPool(int nthreads) : task(NULL), ntasks(0), 
+	next_task(0), running(0), generation(0), stopping(false)
+{
+	for(int i = 1; i < nthreads; ++i){
+		workers.push_back(thread(&ThreadPool::Work, this));
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		unique_lock<mutex> lock(mtx);
+		stopping = true;
+	}
+	work_cv.notify_all();
+
+	for(int i = 0; i < workers.size(); ++i){
+		workers[i].join();
+	}
+}
+
+void ThreadPool::Work()
+{
+	long seen = 0;
+	unique_lock<mutex> lock(mtx);
+	while(true){
+		work_cv.wait(lock, [&]{ return stopping || generation != seen; });
+		if(stopping)
+			return;
+
+		seen = generation;
+		Drain(lock);
+	}
+}
+
+// Run tasks from the current batch until none remain. Called, and 
+// returns, with the lock held.
+void ThreadPool::Drain(unique_lock<mutex> &lock)
+{
+	++running;
+	while(next_task < ntasks && !error){
+		int i = next_task++;
+		lock.unlock();
+		try
+		{
+			(*task)(i);
+			lock.lock();
+		}
+		catch(...)
+		{
+			lock.lock();
+			if(!error)
+				error = current_exception();
+		}
+	}
+
+	if(--running == 0)
+		done_cv.notify_all();
+}
+
+void ThreadPool::Run(int n, const function<void(int)> &fn)
+{
+	unique_lock<mutex> lock(mtx);
+	task = &fn;
+	ntasks = n;
+	next_task = 0;
+	error = exception_ptr();
+	++generation;
+	work_cv.notify_all();
+
+	Drain(lock);
+	done_cv.wait(lock, [&]{ return running == 0; });
+
+	task = NULL;
+	if(error){
+		exception_ptr e = error;
+		error = exception_ptr();
+		rethrow_exception(e);
+	}
+}
+
+BallotIDSet::BallotIDSet(bool exact_ids) : table(1024, 0), count(0), 
+	id_bytes(0), long_ids(0), exact(exact_ids)
+{
+	if(exact){
+		interned.resize(table.size(), 0);
+	}
+}
+
+uint64_t Fingerprint(const char *b, const char *e)
+{
+	// FNV-1a, followed by a final avalanche step so that the low bits 
+	// can be used directly as a table index.
+	uint64_t h = 14695981039346656037ULL;
+	for( ; b < e; ++b){
+		h ^= (unsigned char)*b;
+		h *= 1099511628211ULL;
+	}
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	// Zero marks an empty slot.
+	return (h == 0) ? 1 : h;
+}
+
+void BallotIDSet::Grow()
+{
+	vector<uint64_t> old_table(2*table.size(), 0);
+	vector<uint64_t> old_interned(exact ? old_table.size() : 0, 0);
+	old_table.swap(table);
+	old_interned.swap(interned);
+
+	const size_t mask = table.size() - 1;
+	for(size_t i = 0; i < old_table.size(); ++i){
+		if(old_table[i] == 0)
+			continue;
+
+		size_t slot = old_table[i] & mask;
+		while(table[slot] != 0)
+			slot = (slot + 1) & mask;
+
+		table[slot] = old_table[i];
+		if(exact)
+			interned[slot] = old_interned[i];
+	}
+}
+
+// Add a fingerprint to the table, returning false if it (or, in exact
+// mode, the id [b, e)) is already present.
+bool BallotIDSet::Insert(uint64_t fp, const char *b, const char *e)
+{
+	if(10*(count + 1) > 7*table.size()){
+		Grow();
+	}
+
+	const size_t len = e - b;
+	const size_t mask = table.size() - 1;
+	size_t slot = fp & mask;
+	for( ; table[slot] != 0; slot = (slot + 1) & mask){
+		if(table[slot] != fp)
+			continue;
+
+		if(!exact)
+			return false;
+
+		// Interned ids are stored as a 32-bit length followed by the
+		// characters of the id.
+		const char *id = &arena[interned[slot]];
+		uint32_t idlen;
+		memcpy(&idlen, id, sizeof(uint32_t));
+		if(idlen == len && memcmp(id + sizeof(uint32_t), b, len) == 0)
+			return false;
+	}
+
+	table[slot] = fp;
+	if(exact){
+		uint32_t idlen = len;
+		interned[slot] = arena.size();
+		arena.insert(arena.end(), (const char*)&idlen, 
+			(const char*)&idlen + sizeof(uint32_t));
+		arena.insert(arena.end(), b, e);
+	}
+
+	count += 1;
+	return true;
+}
+
+void BallotIDSet::Insert(const char *b, const char *e)
+{
+	if(Insert(Fingerprint(b, e), b, e)){
+		id_bytes += e - b;
+		if(e - b >= 16)
+			long_ids += 1;
+	}
+}
+
+void BallotIDSet::Merge(const BallotIDSet &other)
+{
+	if(exact && !other.exact){
+		throw STVException("Cannot merge inexact ballot ids into an "
+			"exact set.");
+	}
+
+	size_t added = 0;
+	for(size_t i = 0; i < other.table.size(); ++i){
+		if(other.table[i] == 0)
+			continue;
+
+		if(exact){
+			const char *id = &other.arena[other.interned[i]];
+			uint32_t idlen;
+			memcpy(&idlen, id, sizeof(uint32_t));
+			Insert(id + sizeof(uint32_t), id + sizeof(uint32_t) + idlen);
+		}
+		else if(Insert(other.table[i], NULL, NULL)){
+			added += 1;
+		}
+	}
+
+	// Only fingerprints are merged in the inexact case, so the id length
+	// statistics of the new ids are taken pro rata.
+	if(!exact && other.count > 0){
+		id_bytes += (other.id_bytes*added)/other.count;
+		long_ids += (other.long_ids*added)/other.count;
+	}
+}
+
+size_t BallotIDSet::MemoryUsage() const
+{
+	return sizeof(BallotIDSet) + table.capacity()*sizeof(uint64_t) +
+		interned.capacity()*sizeof(uint64_t) + arena.capacity();
+}
+
+size_t BallotIDSet::StringSetMemoryUsage() const
+{
+	// Each element of a std::set<std::string> is a separately allocated
+	// tree node (three pointers and a colour, plus the string object,
+	// plus allocator overhead). Ids too long for the small string buffer
+	// make a second allocation for their characters.
+	const size_t node = 4*sizeof(void*) + sizeof(string) + 16;
+	return sizeof(set<string>) + count*node + id_bytes + long_ids*(16+1);
+}
+
+CandidateSet CandidateSet::Range(int n)
+{
+	CandidateSet set;
+	set.low = (n >= 64) ? ~(uint64_t)0 : (((uint64_t)1 << n) - 1);
+	for(int c = 64; c < n; c += 64){
+		int bits = min(64, n - c);
+		set.high.push_back((bits == 64) ? ~(uint64_t)0 : 
+			(((uint64_t)1 << bits) - 1));
+	}
+	return set;
+}
+
+void CandidateSet::Trim()
+{
+	while(!high.empty() && high.back() == 0){
+		high.pop_back();
+	}
+}
+
+void CandidateSet::insert(int c)
+{
+	const uint64_t bit = (uint64_t)1 << (c & 63);
+	const size_t w = c >> 6;
+	if(w == 0){
+		low |= bit;
+		return;
+	}
+
+	if(high.size() < w){
+		high.resize(w, 0);
+	}
+	high[w-1] |= bit;
+}
+
+void CandidateSet::erase(int c)
+{
+	const uint64_t bit = (uint64_t)1 << (c & 63);
+	const size_t w = c >> 6;
+	if(w == 0){
+		low &= ~bit;
+	}
+	else if(w <= high.size()){
+		high[w-1] &= ~bit;
+		Trim();
+	}
+}
+
+int CandidateSet::size() const
+{
+	int n = __builtin_popcountll(low);
+	for(size_t w = 0; w < high.size(); ++w){
+		n += __builtin_popcountll(high[w]);
+	}
+	return n;
+}
+
+int CandidateSet::Next(int c) const
+{
+	++c;
+	for(size_t w = c >> 6; w <= high.size(); ++w){
+		uint64_t bits = Word(w);
+		if(w == (size_t)(c >> 6)){
+			bits &= ~(uint64_t)0 << (c & 63);
+		}
+		if(bits != 0){
+			return 64*w + __builtin_ctzll(bits);
+		}
+	}
+	return -1;
+}
+
+bool CandidateSet::SubsetOf(const CandidateSet &other) const
+{
+	if(high.size() > other.high.size())
+		return false;
+
+	for(size_t w = 0; w <= high.size(); ++w){
+		if(Word(w) & ~other.Word(w))
+			return false;
+	}
+	return true;
+}
+
+CandidateSet CandidateSet::operator-(const CandidateSet &other) const
+{
+	CandidateSet set(*this);
+	set.low &= ~other.low;
+	for(size_t w = 0; w < set.high.size(); ++w){
+		set.high[w] &= ~other.Word(w+1);
+	}
+	set.Trim();
+	return set;
+}
+
+bool CandidateList::contains(int c) const
+{
+	for(int i = 0; i < n; ++i){
+		if(items[i] == c)
+			return true;
+	}
+	return false;
+}
+
+void BallotStore::Reset(int ncandidates)
+{
+	if(ncandidates > 65536){
+		throw STVException("Too many candidates in contest.");
+	}
+
+	offsets.assign(1, 0);
+	prefs8.clear();
+	prefs16.clear();
+	wide = (ncandidates > 256);
+}
+
+void BallotStore::Add(const int *first, const int *last)
+{
+	if(wide){
+		prefs16.insert(prefs16.end(), first, last);
+	}
+	else{
+		prefs8.insert(prefs8.end(), first, last);
+	}
+	offsets.push_back(offsets.back() + (last - first));
+}
+
+void BallotStore::Assign(const uint32_t *offs, size_t n, const void *prefs)
+{
+	offsets.assign(offs, offs + n + 1);
+	if(wide){
+		const uint16_t *p = (const uint16_t*)prefs;
+		prefs16.assign(p, p + offsets.back());
+	}
+	else{
+		const uint8_t *p = (const uint8_t*)prefs;
+		prefs8.assign(p, p + offsets.back());
+	}
+}
+
+void BallotStore::Prefs(size_t i, Ints &prefs) const
+{
+	prefs.clear();
+	for(uint32_t k = offsets[i]; k < offsets[i+1]; ++k){
+		prefs.push_back(wide ? prefs16[k] : prefs8[k]);
+	}
+}
+
+// The histogram kernels take the first preference of each ballot from the
+// prefix of the ballot's preferences at offsets[i], with a 4 byte gather, so 
+// stop short of the last few preferences (those are counted by the scalar 
+// loop). Counts are spread over a sub-histogram per vector lane, so that 
+// runs of ballots with the same first preference do not stall on a single
+// counter.
+#ifdef X86_HISTOGRAM_KERNELS
+__attribute__((target("avx2")))
+static size_t FirstPreferencesAVX2(const uint32_t *offsets, size_t first,
+	size_t last, const void *prefs, int width, size_t nprefs, Ints &counts)
+{
+	const int ncand = counts.size();
+	vector<int> hist(8*ncand, 0);
+
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i keep = _mm256_set1_epi32((width == 1) ? 0xFF : 0xFFFF);
+	alignas(32) int cands[8];
+	alignas(32) int nonempty[8];
+
+	size_t i = first;
+	for( ; i + 8 <= last && offsets[i+7] + 4/width <= nprefs; i += 8){
+		__m256i b = _mm256_loadu_si256((const __m256i*)&offsets[i]);
+		__m256i e = _mm256_loadu_si256((const __m256i*)&offsets[i+1]);
+		__m256i mask = _mm256_cmpgt_epi32(e, b);
+		__m256i c = (width == 1) ? 
+			_mm256_mask_i32gather_epi32(zero, (const int*)prefs, b, mask, 1):
+			_mm256_mask_i32gather_epi32(zero, (const int*)prefs, b, mask, 2);
+		_mm256_store_si256((__m256i*)cands, _mm256_and_si256(c, keep));
+		_mm256_store_si256((__m256i*)nonempty, mask);
+
+		for(int l = 0; l < 8; ++l){
+			hist[l*ncand + cands[l]] -= nonempty[l];
+		}
+	}
+
+	for(int l = 0; l < 8; ++l){
+		for(int c = 0; c < ncand; ++c){
+			counts[c] += hist[l*ncand + c];
+		}
+	}
+	return i;
+}
+
+__attribute__((target("avx512f")))
+static size_t FirstPreferencesAVX512(const uint32_t *offsets, size_t first,
+	size_t last, const void *prefs, int width, size_t nprefs, Ints &counts)
+{
+	const int ncand = counts.size();
+	vector<int> hist(16*ncand, 0);
+
+	const __m512i zero = _mm512_setzero_si512();
+	const __m512i one = _mm512_set1_epi32(1);
+	const __m512i keep = _mm512_set1_epi32((width == 1) ? 0xFF : 0xFFFF);
+	const __m512i lane = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 
+		10, 11, 12, 13, 14, 15);
+
+	size_t i = first;
+	for( ; i + 16 <= last && offsets[i+15] + 4/width <= nprefs; i += 16){
+		__m512i b = _mm512_loadu_si512(&offsets[i]);
+		__m512i e = _mm512_loadu_si512(&offsets[i+1]);
+		__mmask16 mask = _mm512_cmpgt_epu32_mask(e, b);
+		__m512i c = (width == 1) ? 
+			_mm512_mask_i32gather_epi32(zero, mask, b, prefs, 1) :
+			_mm512_mask_i32gather_epi32(zero, mask, b, prefs, 2);
+		c = _mm512_and_si512(c, keep);
+
+		__m512i addr = _mm512_add_epi32(_mm512_slli_epi32(c, 4), lane);
+		__m512i h = _mm512_mask_i32gather_epi32(zero, mask, addr, 
+			hist.data(), 4);
+		_mm512_mask_i32scatter_epi32(hist.data(), mask, addr, 
+			_mm512_add_epi32(h, one), 4);
+	}
+
+	for(int c = 0; c < ncand; ++c){
+		for(int l = 0; l < 16; ++l){
+			counts[c] += hist[16*c + l];
+		}
+	}
+	return i;
+}
+#endif
+
+void BallotStore::CountFirstPreferences(size_t first, Ints &counts) const
+{
+	const size_t last = size();
+	size_t i = first;
+	if(counts.empty())
+		return;
+
+#ifdef X86_HISTOGRAM_KERNELS
+	static const int kernel = (__builtin_cpu_init(), 
+		__builtin_cpu_supports("avx512f") ? 2 :
+		__builtin_cpu_supports("avx2") ? 1 : 0);
+
+	const void *prefs = wide ? (const void*)prefs16.data() : 
+		(const void*)prefs8.data();
+	const int width = wide ? 2 : 1;
+	if(kernel == 2){
+		i = FirstPreferencesAVX512(offsets.data(), i, last, prefs, width,
+			NumPrefs(), counts);
+	}
+	else if(kernel == 1){
+		i = FirstPreferencesAVX2(offsets.data(), i, last, prefs, width,
+			NumPrefs(), counts);
+	}
+#endif
+
+	for( ; i < last; ++i){
+		if(offsets[i+1] > offsets[i]){
+			counts[Pref(i, 0)] += 1;
+		}
+	}
+}
+
+size_t BallotStore::MemoryUsage() const
+{
+	return sizeof(BallotStore) + offsets.capacity()*sizeof(uint32_t) +
+		prefs8.capacity() + prefs16.capacity()*sizeof(uint16_t);
+}
+
+void BallotTrie::Build(const BallotTypes &btypes)
+{
+	// Visiting rankings in lexicographic order, each shares with the one
+	// before it a prefix (the nodes on the stack) and adds new nodes below.
+	vector<Ints> rankings(btypes.size());
+	for(int i = 0; i < btypes.size(); ++i){
+		btypes.rankings.Prefs(i, rankings[i]);
+	}
+
+	vector<int> order(btypes.size());
+	for(int i = 0; i < order.size(); ++i){
+		order[i] = i;
+	}
+	sort(order.begin(), order.end(), [&](int a, int b){ 
+		return rankings[a] < rankings[b]; });
+
+	cand.assign(1, 0);
+	count.assign(1, 0);
+	ends.assign(1, 0);
+	skip.assign(1, 0);
+
+	vector<uint32_t> path(1, 0);
+	for(int i = 0; i < order.size(); ++i){
+		const Ints &prefs = rankings[order[i]];
+		const int n = btypes.counts[order[i]];
+
+		size_t common = 0;
+		while(common + 1 < path.size() && common < prefs.size() && 
+			cand[path[common+1]] == prefs[common]){
+			++common;
+		}
+		while(path.size() > common + 1){
+			skip[path.back()] = cand.size();
+			path.pop_back();
+		}
+		for(size_t k = common; k < prefs.size(); ++k){
+			path.push_back(cand.size());
+			cand.push_back(prefs[k]);
+			count.push_back(0);
+			ends.push_back(0);
+			skip.push_back(0);
+		}
+
+		for(size_t k = 0; k < path.size(); ++k){
+			count[path[k]] += n;
+		}
+		ends[path.back()] += n;
+	}
+
+	while(!path.empty()){
+		skip[path.back()] = cand.size();
+		path.pop_back();
+	}
+}
+
+// The following helpers scan a comma separated line held in memory, 
+// in place. They mirror the behaviour of Split(), followed by ToType<int>,
+// on each column: empty columns are skipped, and whitespace surrounding a
+// column is ignored.
+inline bool IsSpace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+const char* FindLineEnd(const char *p, const char *end)
+{
+	const char *nl = (const char*)memchr(p, '\n', end - p);
+	return (nl == NULL) ? end : nl;
+}
+
+// Find the next non-empty column in [p, eol), returning its trimmed
+// extent in [fb, fe). Advances p past the column.
+bool NextColumn(const char *&p, const char *eol, const char *&fb, 
+	const char *&fe)
+{
+	while(p < eol && *p == ',')
+		++p;
+
+	if(p == eol)
+		return false;
+
+	fb = p;
+	while(p < eol && *p != ',')
+		++p;
+
+	fe = p;
+	while(fb < fe && IsSpace(*fb))
+		++fb;
+	while(fe > fb && IsSpace(*(fe-1)))
+		--fe;
+
+	return true;
+}
+
+int ColumnToInt(const char *fb, const char *fe)
+{
+	bool neg = false;
+	if(fb < fe && (*fb == '-' || *fb == '+')){
+		neg = (*fb == '-');
+		++fb;
+	}
+
+	if(fb == fe)
+		throw STVException("Lexical cast problem");
+
+	long long v = 0;
+	for( ; fb < fe; ++fb){
+		if(*fb < '0' || *fb > '9')
+			throw STVException("Lexical cast problem");
+
+		v = 10*v + (*fb - '0');
+		if(v > (long long)INT_MAX + 1)
+			throw STVException("Lexical cast problem");
+	}
+
+	if(neg) v = -v;
+	if(v > INT_MAX)
+		throw STVException("Lexical cast problem");
+
+	return (int)v;
+}
+
+int NextIntColumn(const char *&p, const char *eol)
+{
+	const char *fb, *fe;
+	if(!NextColumn(p, eol, fb, fe))
+		throw STVException("Missing column in reported ballots.");
+
+	return ColumnToInt(fb, fe);
+}
+
+// Ballots parsed from one chunk of a reported ballots file, in file
+// order: the contest index of each, and their preferences (in CSR form).
+struct BallotChunk
+{
+	Ints contest;
+	std::vector<uint32_t> offsets;
+	Ints prefs;
+	BallotIDSet ids;
+
+	BallotChunk(bool exact_ids = false) : offsets(1, 0), ids(exact_ids) {}
+};
+
+void ParseBallotChunk(const char *p, const char *end, 
+	const Contests &contests, const ID2IX &ct_id2index, BallotChunk &chunk,
+	BallotIDSet &ballot_ids)
+{
+	const char *eol, *fb, *fe;
+	for( ; p < end; p = (eol == end) ? end : eol + 1)
+	{
+		eol = FindLineEnd(p, end);
+
+		if(!NextColumn(p, eol, fb, fe))
+			continue;
+
+		int con_id = ColumnToInt(fb, fe);
+		ID2IX::const_iterator cit = ct_id2index.find(con_id);
+		if(cit == ct_id2index.end())
+			continue;
+
+		int con_index = cit->second;
+		const Contest &ctest = contests[con_index];
+
+		if(!NextColumn(p, eol, fb, fe)){
+			throw STVException("Ballot without identifier.");
+		}
+		ballot_ids.Insert(fb, fe);
+
+		while(NextColumn(p, eol, fb, fe))
+		{
+			int ccode = ColumnToInt(fb, fe);
+			ID2IX::const_iterator it = ctest.id2index.find(ccode);
+			if(it == ctest.id2index.end()){
+				throw STVException("Ballot refers to unknown candidate.");
+			}
+
+			chunk.prefs.push_back(it->second);
+		}
+
+		chunk.contest.push_back(con_index);
+		chunk.offsets.push_back(chunk.prefs.size());
+	}
+}
+
+// Add the ballots of a contest, from ballot 'first' onwards, to the first
+// preference totals of its candidates and its number of ballots.
+static void AddBallotTotals(Contest &ctest, size_t first)
+{
+	Ints counts(ctest.ncandidates, 0);
+	ctest.ballots.CountFirstPreferences(first, counts);
+	for(int c = 0; c < ctest.ncandidates; ++c){
+		ctest.cands[c].total_votes += counts[c];
+	}
+
+	// Note, normally we would ignore ballots with no preferences. However,
+	// we may pull them out during sampling when the audit is run, so they
+	// should still be counted toward the total number of ballots that are
+	// present. 
+	ctest.num_rballots += ctest.ballots.size() - first;
+}
+
 bool ReadReportedBallots(const char *path, Contests &contests, 
-    ID2IX &ct_id2index, set<string> &ballot_ids, const Parameters &params) 
+    ID2IX &ct_id2index, BallotIDSet &ballot_ids, const Parameters &params) 
 {
 	try
 	{
-		ifstream infile(path);
-		boostcharsep spcom(",");
+		MappedFile infile;
+		if(!infile.Open(path)){
+			throw STVException("Could not open reported ballots file.");
+		}
+
+		const char *p = infile.begin();
+		const char *end = infile.end();
 
         // The first chunk of lines are related to contest
         // information.
-        string line;
-        getline(infile, line);
-        boost::algorithm::trim(line);
-	    int ncontests = ToType<int>(line);
+		const char *eol = FindLineEnd(p, end);
+		const char *fb = p, *fe = eol;
+		while(fb < fe && IsSpace(*fb)) ++fb;
+		while(fe > fb && IsSpace(*(fe-1))) --fe;
+	    int ncontests = ColumnToInt(fb, fe);
+		p = (eol == end) ? end : eol + 1;
 
         bool add_all_contests = contests.empty();
 
         for(int i = 0; i < ncontests; ++i)
         {
-            getline(infile, line);
-		    vector<string> columns;
-		    Split(line, spcom, columns);
+			if(p == end){
+				throw STVException("Missing contest in reported ballots.");
+			}
+
+			eol = FindLineEnd(p, end);
+
+			// Skip the leading "Contest" column.
+			if(!NextColumn(p, eol, fb, fe)){
+				throw STVException("Missing contest in reported ballots.");
+			}
              
-            int con_id = ToType<int>(columns[1]);
+            int con_id = NextIntColumn(p, eol);
             ID2IX::const_iterator cit = ct_id2index.find(con_id);
             if(add_all_contests && cit == ct_id2index.end()){
                 ct_id2index.insert(pair<int,int>(con_id,contests.size()));
@@ -153,15 +935,17 @@ bool ReadReportedBallots(const char *path, Contests &contests,
                 cit = ct_id2index.find(con_id);
             }
 
-            if(cit == ct_id2index.end())
+            if(cit == ct_id2index.end()){
+				p = (eol == end) ? end : eol + 1;
                 continue;
+			}
 
             int con_index = cit->second;
             Contest &ctest = contests[con_index];
-            int numcand = ToType<int>(columns[2]);
+            int numcand = NextIntColumn(p, eol);
 
             for(int j = 0; j < numcand; ++j){
-                int can_id = ToType<int>(columns[3+j]);
+                int can_id = NextIntColumn(p, eol);
                 Candidate c;
 			    c.index = j;
 			    c.id = can_id;
@@ -170,57 +954,240 @@ bool ReadReportedBallots(const char *path, Contests &contests,
             }
 
             ctest.ncandidates = numcand;
+			ctest.ballots.Reset(numcand);
+			p = (eol == end) ? end : eol + 1;
         }
 
         // Reading ballots rankings and mapping them to their contest.
-        while(getline(infile, line))
-        {
-			vector<string> columns;
-			Split(line, spcom, columns);
+		// Each ballot line is independent of the others, so with multiple
+		// threads the remainder of the file is split into line aligned
+		// chunks that are parsed concurrently, and then merged in order.
+		int nchunks = (params.threads > 1) ? 4*params.threads : 1;
+		vector<const char*> bounds(1, p);
+		for(int k = 1; k < nchunks; ++k){
+			const char *q = p + ((end - p)*(long long)k)/nchunks;
+			q = max(q, bounds.back());
+			q = (q == end) ? end : FindLineEnd(q, end);
+			bounds.push_back((q == end) ? end : q + 1);
+		}
+		bounds.push_back(end);
 
-            int con_id = ToType<int>(columns[0]);
-            ID2IX::const_iterator cit = ct_id2index.find(con_id);
-            if(cit == ct_id2index.end())
-                continue;
+		vector<BallotChunk> chunks(nchunks, 
+			BallotChunk(ballot_ids.is_exact()));
+		if(nchunks == 1){
+			ParseBallotChunk(p, end, contests, ct_id2index, chunks[0], 
+				ballot_ids);
+		}
+		else{
+			ThreadPool pool(params.threads);
+			pool.Run(nchunks, [&](int k){
+				ParseBallotChunk(bounds[k], bounds[k+1], contests, 
+					ct_id2index, chunks[k], chunks[k].ids);
+			});
+		}
 
-            int con_index = cit->second;
-            Contest &ctest = contests[con_index];
- 
-			Ints prefs;
+		for(int k = 0; k < nchunks; ++k){
+			BallotChunk &chunk = chunks[k];
+			for(int i = 0; i < chunk.contest.size(); ++i){
+				Contest &ctest = contests[chunk.contest[i]];
+				const int *first = chunk.prefs.data() + chunk.offsets[i];
+				const int *last = chunk.prefs.data() + chunk.offsets[i+1];
+				ctest.ballots.Add(first, last);
+			}
+
+			ballot_ids.Merge(chunk.ids);
+			chunk = BallotChunk();
+		}
+
+		for(int i = 0; i < contests.size(); ++i){
+			AddBallotTotals(contests[i], 0);
+			BuildBallotTypes(contests[i]);
+		}
+	}
+	catch(exception &e)
+	{
+		throw e;
+	}
+	catch(STVException &e)
+	{
+		throw e;
+	}
+	catch(...)
+	{
+		cout << "Unexpected error reading in reported ballots." << endl;
+		return false;
+	}
+
+	return true;
+}
+
+
+void BuildBallotTypes(Contest &ctest)
+{
+	ctest.btypes.rankings.Reset(ctest.ncandidates);
+	ctest.btypes.counts.clear();
+	UpdateBallotTypes(ctest, 0);
+}
+
+void UpdateBallotTypes(Contest &ctest, size_t first)
+{
+	I2Map type_index;
+	BallotTypes &btypes = ctest.btypes;
+
+	Ints prefs;
+	for(int i = 0; i < btypes.size(); ++i){
+		btypes.rankings.Prefs(i, prefs);
+		type_index.insert(pair<Ints,int>(prefs, i));
+	}
+
+	for(size_t i = first; i < ctest.ballots.size(); ++i){
+		ctest.ballots.Prefs(i, prefs);
+		I2Map::iterator it = type_index.find(prefs);
+		if(it != type_index.end()){
+			btypes.counts[it->second] += 1;
+			continue;
+		}
+
+		type_index.insert(pair<Ints,int>(prefs, btypes.size()));
+		btypes.rankings.Add(prefs);
+		btypes.counts.push_back(1);
+	}
+
+	ctest.trie.Build(btypes);
+}
 
-			Ballot b;
-			b.tag = ctest.num_rballots;
+bool AppendReportedBallots(const char *path, Contests &contests,
+	const ID2IX &ct_id2index, BallotIDSet &ballot_ids, 
+	const Parameters &params)
+{
+	// The batch is read as a reported ballots file restricted to the 
+	// contests already loaded, with contests at the same indices.
+	Contests batch;
+	ID2IX batch_id2index(ct_id2index);
+	for(int i = 0; i < contests.size(); ++i){
+		Contest newc;
+		newc.id = contests[i].id;
+		newc.num_rballots = 0;
+		newc.ncandidates = 0;
+		batch.push_back(newc);
+	}
 
-            ballot_ids.insert(columns[1]);
+	if(!ReadReportedBallots(path, batch, batch_id2index, ballot_ids, params))
+		return false;
 
-			for(int i = 2; i < columns.size(); ++i)
-			{
-				int ccode = ToType<int>(columns[i]);
-				int index = ctest.id2index.find(ccode)->second;
-					
-				if(find(prefs.begin(),prefs.end(), index) != prefs.end())
-				{
-					continue;
-				}
+	for(int i = 0; i < contests.size(); ++i){
+		Contest &ctest = contests[i];
+		const Contest &bctest = batch[i];
+		if(bctest.ballots.empty())
+			continue;
+
+		// Candidates may be listed in a different order in the batch.
+		Ints index(bctest.ncandidates, -1);
+		for(int j = 0; j < bctest.ncandidates; ++j){
+			ID2IX::const_iterator it = ctest.id2index.find(
+				bctest.cands[j].id);
+			if(it == ctest.id2index.end()){
+				throw STVException("Ballot batch refers to unknown "
+					"candidate.");
+			}
+			index[j] = it->second;
+		}
 
-				b.prefs.push_back(index);
+		size_t first = ctest.ballots.size();
+		Ints prefs;
+		for(int j = 0; j < bctest.ballots.size(); ++j){
+			bctest.ballots.Prefs(j, prefs);
+			for(int k = 0; k < prefs.size(); ++k){
+				prefs[k] = index[prefs[k]];
 			}
+			ctest.ballots.Add(prefs);
+		}
 
-			ctest.aballots.push_back(b);
-            ctest.rballots.push_back(b);
+		AddBallotTotals(ctest, first);
+		UpdateBallotTypes(ctest, first);
+	}
 
-            // Note, normally we would ignore ballots with no preferences.
-            // However, we may pull them out during sampling when the audit
-            // is run, so they should still be counted toward the total
-            // number of ballots that are present. 
-            if(!b.prefs.empty()){
-			    Candidate &cand = ctest.cands[b.prefs.front()];
-			    cand.total_votes += 1;
-            }
-			ctest.num_rballots += 1;
+	return true;
+}
+
+
+bool ReadReportedTotals(const char *path, Contests &contests,
+	ID2IX &ct_id2index, int &nballots)
+{
+	try
+	{
+		MappedFile infile;
+		if(!infile.Open(path)){
+			throw STVException("Could not open reported totals file.");
+		}
+
+		const char *p = infile.begin();
+		const char *end = infile.end();
+
+		const char *eol = FindLineEnd(p, end);
+		int ncontests = NextIntColumn(p, eol);
+		if(ncontests != 1){
+			throw STVException("Totals files must describe one contest.");
+		}
+		p = (eol == end) ? end : eol + 1;
+
+		// Skip the leading "Contest" column.
+		const char *fb, *fe;
+		eol = FindLineEnd(p, end);
+		if(!NextColumn(p, eol, fb, fe)){
+			throw STVException("Missing contest in reported totals.");
+		}
+
+		int con_id = NextIntColumn(p, eol);
+		ID2IX::const_iterator cit = ct_id2index.find(con_id);
+		if(contests.empty() && cit == ct_id2index.end()){
+			ct_id2index.insert(pair<int,int>(con_id,contests.size()));
+			Contest newc;
+			newc.id = con_id;
+			newc.num_rballots = 0;
+			contests.push_back(newc); 
+			cit = ct_id2index.find(con_id);
+		}
+
+		nballots = 0;
+		if(cit == ct_id2index.end())
+			return true;
+
+		Contest &ctest = contests[cit->second];
+
+		// The candidate count is not always consistent with the ids that
+		// follow it in a totals file, so every listed id is taken to be
+		// a candidate.
+		NextIntColumn(p, eol);
+		while(NextColumn(p, eol, fb, fe)){
+			Candidate c;
+			c.index = ctest.cands.size();
+			c.id = ColumnToInt(fb, fe);
+			ctest.cands.push_back(c);
+			ctest.id2index.insert(pair<int,int>(c.id, c.index));
 		}
+		ctest.ncandidates = ctest.cands.size();
+		ctest.ballots.Reset(ctest.ncandidates);
 
-		infile.close();
+		for(p = (eol == end) ? end : eol + 1; p < end; 
+			p = (eol == end) ? end : eol + 1)
+		{
+			eol = FindLineEnd(p, end);
+			if(!NextColumn(p, eol, fb, fe))
+				continue;
+
+			int can_id = ColumnToInt(fb, fe);
+			ID2IX::const_iterator it = ctest.id2index.find(can_id);
+			if(it == ctest.id2index.end()){
+				throw STVException("Totals refer to unknown candidate.");
+			}
+
+			int votes = NextIntColumn(p, eol);
+			ctest.cands[it->second].total_votes += votes;
+			ctest.num_rballots += votes;
+		}
+
+		nballots = ctest.num_rballots;
 	}
 	catch(exception &e)
 	{
@@ -232,13 +1199,243 @@ bool ReadReportedBallots(const char *path, Contests &contests,
 	}
 	catch(...)
 	{
-		cout << "Unexpected error reading in reported ballots." << endl;
+		cout << "Unexpected error reading in reported totals." << endl;
 		return false;
 	}
 
 	return true;
 }
 
+// Layout of a ballot cache file. Each section that follows a header is
+// padded to a multiple of 8 bytes.
+//
+//   CacheHeader
+//   for each contest:
+//     CacheContest
+//     int32_t  candidate ids [ncandidates]
+//     uint32_t ballot offsets [nballots + 1]
+//     uint8_t or uint16_t candidate indices [nprefs]
+const char CACHE_MAGIC[8] = {'R','A','I','R','E','B','C','1'};
+
+struct CacheHeader
+{
+	char magic[8];
+	uint32_t ncontests;
+	uint32_t reserved;
+	uint64_t source_size;
+	int64_t source_mtime;
+	uint64_t nballot_ids;
+};
+
+struct CacheContest
+{
+	int32_t id;
+	int32_t ncandidates;
+	int32_t nballots;
+	int32_t pref_bytes;
+	uint64_t nprefs;
+};
+
+inline size_t Pad8(size_t n)
+{
+	return (n + 7) & ~(size_t)7;
+}
+
+bool ReadBallotCache(const char *path, const char *source, 
+	Contests &contests, ID2IX &ct_id2index, int &nballot_ids)
+{
+	try
+	{
+		if(!boost::filesystem::exists(path))
+			return false;
+
+		MappedFile cache;
+		if(!cache.Open(path))
+			return false;
+
+		const char *p = cache.begin();
+		const char *end = cache.end();
+
+		if(end - p < sizeof(CacheHeader))
+			return false;
+
+		CacheHeader header;
+		memcpy(&header, p, sizeof(CacheHeader));
+		p += sizeof(CacheHeader);
+
+		if(memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 ||
+			header.source_size != boost::filesystem::file_size(source) ||
+			header.source_mtime != boost::filesystem::last_write_time(source))
+			return false;
+
+		Contests cached;
+		ID2IX cached_id2index;
+		for(int i = 0; i < header.ncontests; ++i){
+			if(end - p < sizeof(CacheContest))
+				return false;
+
+			CacheContest cc;
+			memcpy(&cc, p, sizeof(CacheContest));
+			p += sizeof(CacheContest);
+
+			size_t ids_size = Pad8(cc.ncandidates*sizeof(int32_t));
+			size_t offs_size = Pad8((cc.nballots+1)*sizeof(uint32_t));
+			size_t prefs_size = Pad8(cc.nprefs*cc.pref_bytes);
+			if(cc.ncandidates < 0 || cc.nballots < 0 || 
+				(cc.pref_bytes != 1 && cc.pref_bytes != 2) ||
+				end - p < ids_size + offs_size + prefs_size)
+				return false;
+
+			const int32_t *ids = (const int32_t*)p;
+			const uint32_t *offsets = (const uint32_t*)(p + ids_size);
+			const char *prefs = p + ids_size + offs_size;
+			p += ids_size + offs_size + prefs_size;
+
+			if(offsets[cc.nballots] != cc.nprefs)
+				return false;
+
+			cached_id2index.insert(pair<int,int>(cc.id, cached.size()));
+			cached.push_back(Contest());
+			Contest &ctest = cached.back();
+			ctest.id = cc.id;
+			ctest.ncandidates = cc.ncandidates;
+			ctest.num_rballots = 0;
+
+			for(int j = 0; j < cc.ncandidates; ++j){
+				Candidate c;
+				c.index = j;
+				c.id = ids[j];
+				ctest.cands.push_back(c);
+				ctest.id2index.insert(pair<int,int>(c.id, j));
+			}
+
+			for(int j = 0; j < cc.nballots; ++j){
+				if(offsets[j] > offsets[j+1])
+					return false;
+			}
+			for(uint64_t k = 0; k < cc.nprefs; ++k){
+				int index = (cc.pref_bytes == 1) ?
+					((const uint8_t*)prefs)[k] : ((const uint16_t*)prefs)[k];
+				if(index >= cc.ncandidates)
+					return false;
+			}
+
+			// The cache holds ballots in the same form as a BallotStore.
+			ctest.ballots.Reset(cc.ncandidates);
+			if(ctest.ballots.is_wide() != (cc.pref_bytes == 2))
+				return false;
+
+			ctest.ballots.Assign(offsets, cc.nballots, prefs);
+			AddBallotTotals(ctest, 0);
+			BuildBallotTypes(ctest);
+		}
+
+		contests.swap(cached);
+		ct_id2index.swap(cached_id2index);
+		nballot_ids = header.nballot_ids;
+	}
+	catch(...)
+	{
+		return false;
+	}
+
+	return true;
+}
+
+void WritePadded(ofstream &outfile, const void *data, size_t size)
+{
+	const char zeros[8] = {0,0,0,0,0,0,0,0};
+	if(size > 0){
+		outfile.write((const char*)data, size);
+	}
+	outfile.write(zeros, Pad8(size) - size);
+}
+
+bool WriteBallotCache(const char *path, const char *source,
+	const Contests &contests, int nballot_ids)
+{
+	// The cache is written to a temporary file and then moved into
+	// place, so that other processes never map a partially written cache.
+	stringstream ss;
+	ss << path << ".tmp." << getpid();
+	const string tmppath = ss.str();
+
+	try
+	{
+		ofstream outfile(tmppath.c_str(), ios::out | ios::binary);
+		if(!outfile)
+			return false;
+
+		CacheHeader header;
+		memset(&header, 0, sizeof(CacheHeader));
+		memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+		header.ncontests = contests.size();
+		header.source_size = boost::filesystem::file_size(source);
+		header.source_mtime = boost::filesystem::last_write_time(source);
+		header.nballot_ids = nballot_ids;
+		outfile.write((const char*)&header, sizeof(CacheHeader));
+
+		for(int i = 0; i < contests.size(); ++i){
+			const Contest &ctest = contests[i];
+
+			CacheContest cc;
+			memset(&cc, 0, sizeof(CacheContest));
+			cc.id = ctest.id;
+			cc.ncandidates = ctest.ncandidates;
+			cc.nballots = ctest.ballots.size();
+			cc.pref_bytes = ctest.ballots.is_wide() ? 2 : 1;
+			cc.nprefs = ctest.ballots.NumPrefs();
+
+			vector<int32_t> ids(ctest.ncandidates);
+			for(int j = 0; j < ctest.ncandidates; ++j){
+				ids[j] = ctest.cands[j].id;
+			}
+
+			outfile.write((const char*)&cc, sizeof(CacheContest));
+			WritePadded(outfile, ids.empty() ? NULL : &ids[0], 
+				ids.size()*sizeof(int32_t));
+			WritePadded(outfile, ctest.ballots.Offsets(),
+				(cc.nballots + 1)*sizeof(uint32_t));
+			if(ctest.ballots.is_wide()){
+				WritePadded(outfile, ctest.ballots.Prefs16(),
+					cc.nprefs*sizeof(uint16_t));
+			}
+			else{
+				WritePadded(outfile, ctest.ballots.Prefs8(), cc.nprefs);
+			}
+		}
+
+		outfile.close();
+		if(!outfile){
+			remove(tmppath.c_str());
+			return false;
+		}
+
+		boost::filesystem::rename(tmppath, path);
+	}
+	catch(...)
+	{
+		remove(tmppath.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+
+void BuildCandidateBallots(Contest &ctest)
+{
+	for(int i = 0; i < ctest.cands.size(); ++i){
+		ctest.cands[i].ballots.clear();
+	}
+
+	for(int j = 0; j < ctest.ballots.size(); ++j){
+		if(ctest.ballots.Length(j) == 0)
+			continue;
+		ctest.cands[ctest.ballots.Pref(j, 0)].ballots.push_back(j);
+	}
+}
+
 
 bool ReadReportedOutcomes(const char *path, Contests &contests, 
     ID2IX &ct_id2index) 
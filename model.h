@@ -22,11 +22,17 @@
 #include<vector>
 #include<set>
 #include<exception>
+#include<stdint.h>
 #include<boost/lexical_cast.hpp>
 #include<boost/filesystem.hpp>
 #include<boost/tokenizer.hpp>
 #include<boost/algorithm/string.hpp>
 #include<map>
+#include<functional>
+#include<thread>
+#include<mutex>
+#include<condition_variable>
+#include<exception>
 
 #ifndef _WIN32
 #include<sys/time.h>
@@ -73,27 +79,290 @@ class STVException
 };
 
 
+// Read-only view of the contents of a file. Where available the file is
+// memory mapped, so that it can be scanned in place without copying.
+class MappedFile
+{
+	private:
+		const char *data;
+		size_t length;
+		bool mapped;
+		std::vector<char> buffer;
+
+		MappedFile(const MappedFile &);
+		MappedFile& operator=(const MappedFile &);
+
+	public:
+		MappedFile() : data(NULL), length(0), mapped(false) {}
+		~MappedFile() { Close(); }
+
+		bool Open(const char *path);
+		void Close();
+
+		const char* begin() const { return data; }
+		const char* end() const { return data + length; }
+		size_t size() const { return length; }
+};
+
+
+// A fixed set of worker threads. Run() farms out a batch of indexed tasks
+// to the workers (and the calling thread), and returns once all of them
+// have completed. An exception thrown by a task is rethrown from Run().
+class ThreadPool
+{
+	private:
+		std::vector<std::thread> workers;
+		std::mutex mtx;
+		std::condition_variable work_cv;
+		std::condition_variable done_cv;
+
+		const std::function<void(int)> *task;
+		int ntasks;
+		int next_task;
+		int running;
+		long generation;
+		bool stopping;
+		std::exception_ptr error;
+
+		void Work();
+		void Drain(std::unique_lock<std::mutex> &lock);
+
+		ThreadPool(const ThreadPool &);
+		ThreadPool& operator=(const ThreadPool &);
+
+	public:
+		ThreadPool(int nthreads);
+		~ThreadPool();
+
+		int size() const { return workers.size() + 1; }
+
+		void Run(int ntasks, const std::function<void(int)> &task);
+};
+
+// Counts distinct ballot ids. Each id is reduced to a 64-bit fingerprint,
+// and fingerprints are kept in an open addressing hash table. Two distinct
+// ids colliding on a fingerprint would be counted once; the chance of this
+// is around n^2/2^65 for n ids. In exact mode, ids are also interned in a
+// string arena so that fingerprint collisions are resolved exactly.
+class BallotIDSet
+{
+	private:
+		std::vector<uint64_t> table;
+		std::vector<uint64_t> interned;
+		std::vector<char> arena;
+
+		size_t count;
+		size_t id_bytes;
+		size_t long_ids;
+		bool exact;
+
+		void Grow();
+		bool Insert(uint64_t fp, const char *b, const char *e);
+
+	public:
+		BallotIDSet(bool exact_ids = false);
+
+		void Insert(const char *b, const char *e);
+		void Insert(const std::string &id){Insert(id.data(),id.data()+id.size());}
+
+		// Add all ids in another set to this one.
+		void Merge(const BallotIDSet &other);
+
+		size_t size() const { return count; }
+		bool is_exact() const { return exact; }
+
+		// Bytes of memory held by the set, and an estimate of the memory
+		// a std::set<std::string> of the same ids would hold.
+		size_t MemoryUsage() const;
+		size_t StringSetMemoryUsage() const;
+};
+
+// A set of candidates, by index, held as a bit mask. Candidates 0 to 63 are
+// held in a single word, and any others in further words that only the 
+// sets of larger contests need. Members are visited in increasing order.
+class CandidateSet
+{
+	private:
+		uint64_t low;
+
+		// Words for candidates 64 onwards, with no trailing zero words.
+		std::vector<uint64_t> high;
+
+		uint64_t Word(size_t w) const { return (w == 0) ? low :
+			((w <= high.size()) ? high[w-1] : 0); }
+		void Trim();
+
+	public:
+		class const_iterator
+		{
+			private:
+				const CandidateSet *set;
+				int c;
+
+			public:
+				const_iterator(const CandidateSet *s, int i) : set(s), c(i) {}
+
+				int operator*() const { return c; }
+				const_iterator& operator++() { c = set->Next(c); return *this;}
+				bool operator==(const const_iterator &o) const {return c==o.c;}
+				bool operator!=(const const_iterator &o) const {return c!=o.c;}
+		};
+
+		CandidateSet() : low(0) {}
+
+		template<typename It>
+		CandidateSet(It first, It last) : low(0) {
+			for( ; first != last; ++first) insert(*first); }
+
+		// The set of all candidates 0 to n-1.
+		static CandidateSet Range(int n);
+
+		void insert(int c);
+		void erase(int c);
+		void clear() { low = 0; high.clear(); }
+
+		bool contains(int c) const { return (Word(c >> 6) >> (c & 63)) & 1; }
+		bool empty() const { return low == 0 && high.empty(); }
+		int size() const;
+
+		// The smallest member greater than c, or -1 if there is none.
+		int Next(int c) const;
+
+		const_iterator begin() const { return const_iterator(this, Next(-1)); }
+		const_iterator end() const { return const_iterator(this, -1); }
+
+		// The mask of candidates 0 to 63, which is the whole set if narrow.
+		uint64_t Low() const { return low; }
+		bool is_narrow() const { return high.empty(); }
+
+		bool SubsetOf(const CandidateSet &other) const;
+		CandidateSet operator-(const CandidateSet &other) const;
+
+		bool operator==(const CandidateSet &other) const {
+			return low == other.low && high == other.high; }
+		bool operator!=(const CandidateSet &other) const {
+			return !(*this == other); }
+};
+
+// An ordered list of at most MAX_SIZE candidates, held in place so that it 
+// is copied without allocation.
+class CandidateList
+{
+	public:
+		static const int MAX_SIZE = 64;
+
+	private:
+		uint16_t items[MAX_SIZE];
+		int n;
+
+	public:
+		CandidateList() : n(0) {}
+
+		void push_back(int c) { 
+			if(n == MAX_SIZE) throw STVException("Candidate list is full.");
+			items[n++] = c; }
+
+		int size() const { return n; }
+		bool empty() const { return n == 0; }
+		int operator[](int i) const { return items[i]; }
+
+		bool contains(int c) const;
+};
+
 struct Candidate
 {
 	int id;
 	int index;
 	int total_votes;
 
+	// Indices of the ballots on which this candidate is ranked first. 
+	// Only filled in by BuildCandidateBallots().
 	Ints ballots;
-	Ints ballots_where_appear;
 
 	Candidate() : id(0), index(0), total_votes(0) {}
 };
 
 typedef std::vector<Candidate> Candidates;
 
-struct Ballot
+// Ballot rankings in compressed sparse row form: the preferences of 
+// ballot i are entries offsets[i] to offsets[i+1]-1 of a single flat 
+// array of candidate indices. Indices are held in 8 bits when a contest 
+// has at most 256 candidates, and in 16 bits otherwise. A ballot's tag is
+// its position in the store.
+class BallotStore
+{
+	private:
+		std::vector<uint32_t> offsets;
+		std::vector<uint8_t> prefs8;
+		std::vector<uint16_t> prefs16;
+		bool wide;
+
+	public:
+		BallotStore() : offsets(1, 0), wide(false) {}
+
+		// Remove all ballots, and choose the width of candidate indices
+		// to suit a contest with the given number of candidates.
+		void Reset(int ncandidates);
+
+		void Add(const int *first, const int *last);
+		void Add(const Ints &prefs) { Add(prefs.data(), prefs.data() +
+			prefs.size()); }
+
+		// Replace the contents of the store with n ballots given in CSR
+		// form, with candidate indices of the store's width.
+		void Assign(const uint32_t *offs, size_t n, const void *prefs);
+
+		size_t size() const { return offsets.size() - 1; }
+		bool empty() const { return offsets.size() == 1; }
+		bool is_wide() const { return wide; }
+
+		int Length(size_t i) const { return offsets[i+1] - offsets[i]; }
+		int Pref(size_t i, int j) const { return wide ? 
+			prefs16[offsets[i]+j] : prefs8[offsets[i]+j]; }
+		void Prefs(size_t i, Ints &prefs) const;
+
+		// Add to counts[c] the number of ballots, from ballot 'first' on,
+		// that rank candidate c first. Uses AVX-512 or AVX2 instructions 
+		// where the CPU has them.
+		void CountFirstPreferences(size_t first, Ints &counts) const;
+
+		const uint32_t* Offsets() const { return offsets.data(); }
+		const uint8_t* Prefs8() const { return prefs8.data(); }
+		const uint16_t* Prefs16() const { return prefs16.data(); }
+		size_t NumPrefs() const { return offsets.back(); }
+
+		size_t MemoryUsage() const;
+};
+
+// The distinct rankings appearing in a set of ballots, together with the
+// number of ballots that carry each.
+struct BallotTypes
 {
-	int tag;
-	Ints prefs;
+	BallotStore rankings;
+	Ints counts;
+
+	size_t size() const { return counts.size(); }
 };
 
-typedef std::vector<Ballot> Ballots;
+// A prefix trie of the rankings in a table of ballot types, with nodes laid
+// out in depth first order. Node i stands for the ballots whose rankings 
+// begin with the candidates on the path to it: count[i] ballots in all, of
+// which ends[i] rank no further candidates. Its subtree occupies nodes i to
+// skip[i]-1. Node 0 is the root, for the empty prefix. A scan of the trie 
+// can pass over all ballots sharing a prefix at once, by jumping to skip[i].
+struct BallotTrie
+{
+	std::vector<uint16_t> cand;
+	Ints count;
+	Ints ends;
+	std::vector<uint32_t> skip;
+
+	BallotTrie() : cand(1, 0), count(1, 0), ends(1, 0), skip(1, 1) {}
+
+	void Build(const BallotTypes &btypes);
+
+	size_t size() const { return cand.size(); }
+};
 
 typedef std::map<std::vector<int>,int> I2Map;
 typedef std::map<int,int> ID2IX;
@@ -102,8 +371,18 @@ typedef std::map<double,int> d2Int;
 struct Contest{
     int id;
     Candidates cands;
-    Ballots rballots;
-    Ballots aballots;
+    // The ballots of the contest, in the order they were read. This is
+    // the only copy: the reported and audited ballots are views of it.
+    BallotStore ballots;
+
+    const BallotStore& rballots() const { return ballots; }
+    const BallotStore& aballots() const { return ballots; }
+
+    // Distinct rankings appearing in the ballots, with multiplicities.
+    BallotTypes btypes;
+
+    // The same rankings, merged on common prefixes.
+    BallotTrie trie;
 
 	ID2IX id2index;
 
@@ -120,8 +399,16 @@ struct Contest{
 
 typedef std::vector<Contest> Contests;
 
+// How sample sizes with errors are estimated: by simulation, by the 
+// analytical approximation, or by both (reporting how far they differ).
+enum ErrorASN { ERRASN_SIMULATE, ERRASN_APPROX, ERRASN_VALIDATE };
+
 struct Parameters{
     double risk_limit;
+
+    // All risk limits at which sample sizes are reported, in increasing
+    // order. The first is risk_limit, at which audits are generated.
+    Doubles risk_limits;
     int tot_auditable_ballots;
 
     double t;
@@ -129,17 +416,67 @@ struct Parameters{
     double error_rate;
     long seed;
     int reps;
+    ErrorASN error_asn;
 
     int level;
 
     double allowed_gap;
     bool diving;
+
+    int threads;
+
+    // Memory cap for a precomputed IRV tally table, 0 if not used.
+    double tally_table_mb;
 };
 
 bool ReadReportedBallots(const char *path, Contests &contests,
-	ID2IX &contest_id2index, std::set<std::string> &ballot_ids,
+	ID2IX &contest_id2index, BallotIDSet &ballot_ids,
     const Parameters &params);
 
+// Read a file of first preference totals for a single contest: the same
+// contest header as a reported ballots file, followed by one line per
+// candidate giving its id and number of votes. The contest holds no 
+// ballots, only candidate totals, and each vote is taken to be a distinct
+// ballot (nballots is the sum of all totals). Suitable only for plurality
+// audits.
+bool ReadReportedTotals(const char *path, Contests &contests,
+	ID2IX &contest_id2index, int &nballots);
+
+// A binary cache of the contents of a reported ballots file: for each
+// contest, its candidate ids and the preferences of its ballots (as an 
+// offsets array into a flat array of candidate indices), together with 
+// the number of distinct ballot ids. The cache records the size and
+// modification time of the file it was built from, and is rejected if
+// these no longer match.
+bool ReadBallotCache(const char *path, const char *source, 
+	Contests &contests, ID2IX &contest_id2index, int &nballot_ids);
+
+bool WriteBallotCache(const char *path, const char *source,
+	const Contests &contests, int nballot_ids);
+
+// Collapse the reported ballots of a contest into its table of 
+// distinct ballot types, and build the trie of these types.
+void BuildBallotTypes(Contest &ctest);
+
+// Add the ballots of a contest from index 'first' onwards to its table of
+// ballot types, leaving the counts of earlier ballots as they are, and 
+// rebuild the trie of these types.
+void UpdateBallotTypes(Contest &ctest, size_t first);
+
+// Read a further batch of reported ballots (for example, the ballots of one
+// county), in the same format as a reported ballots file, and append them to
+// the contests already loaded. Contests not already loaded are ignored. 
+// Candidate totals and ballot types are updated by the new ballots alone,
+// and their ids are added to ballot_ids.
+bool AppendReportedBallots(const char *path, Contests &contests,
+	const ID2IX &contest_id2index, BallotIDSet &ballot_ids,
+	const Parameters &params);
+
+// Fill in Candidate::ballots for each candidate in the contest. These 
+// lists are not built when ballots are read, and are left to the code
+// paths that need them.
+void BuildCandidateBallots(Contest &ctest);
+
 bool ReadReportedOutcomes(const char *path, Contests &contests,
     ID2IX &contest_id2index);
 